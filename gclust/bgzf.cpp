@@ -0,0 +1,445 @@
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "bgzf.hpp"
+
+const long BGZF_BATCH = 16; // Blocks decompressed per thread and step.
+const long GZ_CHUNK = 1<<20; // Plain gzip bytes per step.
+
+// Read n bytes at off.
+static bool read_at(int fd, void *buf, long n, long off)
+{
+	char *p=(char *)buf;
+	while (n>0)
+	{
+		ssize_t r=pread(fd, p, n, off);
+		if (r<=0){ return false; }
+		p+=r; n-=r; off+=r;
+	}
+	return true;
+
+}
+
+// Size of the BGZF block starting with the n bytes at h, from the BC
+// field of its header, or 0 when it is no BGZF block.
+static long bgzf_block_size(const unsigned char *h, long n)
+{
+	if ((n<18)||(h[0]!=0x1f)||(h[1]!=0x8b)||(h[2]!=8)||((h[3]&4)==0)){ return 0; }
+	long xlen=h[10]|(h[11]<<8);
+	long i=12;
+	while ((i+4<=12+xlen)&&(i+4<=n))
+	{
+		long slen=h[i+2]|(h[i+3]<<8);
+		if ((h[i]=='B')&&(h[i+1]=='C')&&(slen==2)&&(i+6<=n)){ return (h[i+4]|(h[i+5]<<8))+1; }
+		i+=4+slen;
+	}
+	return 0;
+
+}
+
+int gz_format(string filename)
+{
+	unsigned char h[64];
+	int fd=open(filename.c_str(), O_RDONLY);
+	if (fd<0){ return GZ_NONE; }
+	long n=pread(fd, h, sizeof(h), 0);
+	close(fd);
+	if ((n<2)||(h[0]!=0x1f)||(h[1]!=0x8b)){ return GZ_NONE; }
+	return (bgzf_block_size(h, n)>0) ? GZ_BGZF : GZ_PLAIN;
+
+}
+
+// Index the blocks from their headers, from the last block already in
+// idx to the file end.
+static bool walk_bgzf_index(int fd, bgzf_index &idx)
+{
+	struct stat st;
+	unsigned char h[64];
+	uint32_t isize;
+	long c=0, u=0;
+	if (fstat(fd, &st)!=0){ return false; }
+	if (!idx.coff.empty())
+	{
+		c=idx.coff.back(); idx.coff.pop_back();
+		u=idx.uoff.back(); idx.uoff.pop_back();
+	}
+	while (c<st.st_size)
+	{
+		long n=min((long)sizeof(h), (long)st.st_size-c);
+		if (!read_at(fd, h, n, c)){ return false; }
+		long bsize=bgzf_block_size(h, n);
+		if ((bsize==0)||(c+bsize>st.st_size)||(!read_at(fd, &isize, 4, c+bsize-4))){ return false; }
+		idx.coff.push_back(c);
+		idx.uoff.push_back(u);
+		c+=bsize;
+		u+=isize;
+	}
+	idx.coff.push_back(c);
+	idx.uoff.push_back(u);
+	return true;
+
+}
+
+// Note: the .gzi file holds the number of blocks after the first one, 
+// then their compressed and uncompressed offsets, all as 64 bit little
+// endian integers. It is used when not older than the input, the blocks
+// after the last one it lists are walked.
+static bool read_bgzf_index(int fd, string filename, bgzf_index &idx)
+{
+	struct stat st, ist;
+	string name=filename+".gzi";
+	if ((fstat(fd, &st)!=0)||(stat(name.c_str(), &ist)!=0)||(ist.st_mtime<st.st_mtime)){ return false; }
+	ifstream gzi(name.c_str(), ios::binary);
+	uint64_t n;
+	if ((!gzi.read((char *)&n, 8))||((long)ist.st_size!=8+16*(long)n)){ return false; }
+	vector<uint64_t> pairs(2*n+1);
+	if (!gzi.read((char *)&pairs[0], 16*n)){ return false; }
+	idx.coff.assign(1, 0);
+	idx.uoff.assign(1, 0);
+	for (long i=0; i<(long)n; i++)
+	{
+		idx.coff.push_back(pairs[2*i]);
+		idx.uoff.push_back(pairs[2*i+1]);
+	}
+	return (idx.coff.back()<(long)st.st_size)&&(walk_bgzf_index(fd, idx));
+
+}
+
+// Write the .gzi file through a private file renamed into place, 
+// unwritable places are skipped.
+static void write_bgzf_index(string filename, bgzf_index &idx)
+{
+	char pid[32];
+	sprintf(pid, ".%ld", (long)getpid());
+	string name=filename+".gzi", part=name+pid;
+	ofstream gzi(part.c_str(), ios::binary);
+	if (!gzi.is_open()){ return; }
+	uint64_t n=idx.coff.size()-2;
+	gzi.write((char *)&n, 8);
+	for (long i=1; i<=(long)n; i++)
+	{
+		uint64_t pair[2]={(uint64_t)idx.coff[i], (uint64_t)idx.uoff[i]};
+		gzi.write((char *)pair, 16);
+	}
+	gzi.close();
+	if ((gzi.fail())||(rename(part.c_str(), name.c_str())!=0)){ unlink(part.c_str()); }
+
+}
+
+// Indexes of the BGZF files read by the run, kept for the whole run.
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector< pair<string, bgzf_index *> > indexes;
+
+// Block index of filename, NULL when its blocks can not be followed.
+static const bgzf_index *bgzf_open_index(int fd, string filename)
+{
+	bgzf_index *idx=NULL;
+	pthread_mutex_lock(&index_lock);
+	for (long i=0; i<(long)indexes.size(); i++)
+	{
+		if (indexes[i].first==filename){ idx=indexes[i].second; }
+	}
+	if (idx==NULL)
+	{
+		idx=new bgzf_index;
+		if (!read_bgzf_index(fd, filename, *idx))
+		{
+			idx->coff.clear();
+			idx->uoff.clear();
+			if (walk_bgzf_index(fd, *idx))
+			{
+				write_bgzf_index(filename, *idx);
+			}else{
+				delete idx;
+				idx=NULL;
+			}
+		}
+		if (idx!=NULL){ indexes.push_back(make_pair(filename, idx)); }
+	}
+	pthread_mutex_unlock(&index_lock);
+	return idx;
+
+}
+
+// Decompress one BGZF block of n bytes into size bytes.
+static bool inflate_block(const char *src, long n, char *dst, long size)
+{
+	if (size==0){ return true; }
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 15+16)!=Z_OK){ return false; }
+	zs.next_in=(Bytef *)src;
+	zs.avail_in=n;
+	zs.next_out=(Bytef *)dst;
+	zs.avail_out=size;
+	int r=inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	return (r==Z_STREAM_END)&&((long)zs.total_out==size);
+
+}
+
+// Blocks [first, last) of one step for one thread.
+struct inflate_job
+{
+	const bgzf_index *index;
+	const char *in;
+	char *out;
+	long first, last;
+	bool ok;
+
+};
+
+static void *inflate_blocks(void *arg)
+{
+	inflate_job &job=*(inflate_job *)arg;
+	const bgzf_index &idx=*job.index;
+	long cbase=idx.coff[job.first], ubase=idx.uoff[job.first];
+	job.ok=true;
+	for (long b=job.first; b<job.last; b++)
+	{
+		if (!inflate_block(job.in+idx.coff[b]-cbase, idx.coff[b+1]-idx.coff[b], 
+											 job.out+idx.uoff[b]-ubase, idx.uoff[b+1]-idx.uoff[b])){ job.ok=false; }
+	}
+	return NULL;
+
+}
+
+gz_streambuf::gz_streambuf(string filename, int format_, int threads_) : fd(-1), 
+	format(format_), threads(max(1, threads_)), index(NULL), block(0), base(0), 
+	zs(NULL), coff(0), zend(false)
+{
+	ramp=threads*BGZF_BATCH;
+	fd=open(filename.c_str(), O_RDONLY);
+	if (fd<0){ return; }
+	if (format==GZ_BGZF)
+	{
+		index=bgzf_open_index(fd, filename);
+		// Note: blocks that can not be followed are read as one stream.
+		if (index==NULL){ format=GZ_PLAIN; }
+	}
+	if (format==GZ_PLAIN)
+	{
+		z_stream *z=new z_stream;
+		memset(z, 0, sizeof(*z));
+		inflateInit2(z, 15+16);
+		zs=z;
+	}
+	setg(NULL, NULL, NULL);
+
+}
+
+gz_streambuf::~gz_streambuf()
+{
+	if (zs!=NULL)
+	{
+		inflateEnd((z_stream *)zs);
+		delete (z_stream *)zs;
+	}
+	if (fd>=0){ close(fd); }
+
+}
+
+// Decompress the next blocks, a batch per thread.
+// Note: after a seek the batch starts at one block and doubles, a read
+// of one genome does not decompress a whole batch.
+bool gz_streambuf::fill_bgzf()
+{
+	long nblocks=(long)index->coff.size()-1;
+	if (block>=nblocks){ return false; }
+	long nb=min(ramp, nblocks-block);
+	ramp=min(ramp*2, threads*BGZF_BATCH);
+	long cbase=index->coff[block], ubase=index->uoff[block];
+	in.resize(index->coff[block+nb]-cbase);
+	out.resize(index->uoff[block+nb]-ubase);
+	if (!read_at(fd, &in[0], in.size(), cbase))
+	{
+		cerr << "unable to read the compressed input" << endl;
+		exit(1);
+	}
+	long parts=min((long)threads, nb);
+	vector<inflate_job> jobs(parts);
+	vector<pthread_t> ids(parts);
+	for (long t=0; t<parts; t++)
+	{
+		jobs[t].index=index;
+		jobs[t].first=block+nb*t/parts;
+		jobs[t].last=block+nb*(t+1)/parts;
+		jobs[t].in=&in[0]+index->coff[jobs[t].first]-cbase;
+		jobs[t].out=out.data()+index->uoff[jobs[t].first]-ubase;
+		if (t>0){ pthread_create(&ids[t], NULL, inflate_blocks, &jobs[t]); }
+	}
+	inflate_blocks(&jobs[0]);
+	for (long t=1; t<parts; t++){ pthread_join(ids[t], NULL); }
+	for (long t=0; t<parts; t++)
+	{
+		if (!jobs[t].ok)
+		{
+			cerr << "corrupt block in the compressed input" << endl;
+			exit(1);
+		}
+	}
+	base=ubase;
+	block+=nb;
+	setg(out.data(), out.data(), out.data()+out.size());
+	return true;
+
+}
+
+// Decompress the next bytes of a gzip stream, members of concatenated
+// gzip files follow each other.
+bool gz_streambuf::fill_plain()
+{
+	z_stream *z=(z_stream *)zs;
+	base+=egptr()-eback();
+	out.resize(GZ_CHUNK);
+	z->next_out=(Bytef *)&out[0];
+	z->avail_out=GZ_CHUNK;
+	while (z->avail_out>0)
+	{
+		if (z->avail_in==0)
+		{
+			if (zend){ break; }
+			in.resize(GZ_CHUNK);
+			ssize_t r=pread(fd, &in[0], GZ_CHUNK, coff);
+			if (r<=0)
+			{
+				zend=true;
+				break;
+			}
+			coff+=r;
+			z->next_in=(Bytef *)&in[0];
+			z->avail_in=r;
+		}
+		int r=inflate(z, Z_NO_FLUSH);
+		if (r==Z_STREAM_END)
+		{
+			// Bytes after a member that start no new member are ignored.
+			if ((z->avail_in>0)&&(z->next_in[0]!=0x1f))
+			{
+				zend=true;
+				z->avail_in=0;
+			}
+			inflateReset(z);
+		}else if ((r!=Z_OK)&&(r!=Z_BUF_ERROR))
+		{
+			cerr << "corrupt compressed input" << endl;
+			exit(1);
+		}
+	}
+	long n=GZ_CHUNK-z->avail_out;
+	setg(&out[0], &out[0], &out[0]+n);
+	return n>0;
+
+}
+
+// Go back to the start of a gzip stream.
+bool gz_streambuf::restart_plain()
+{
+	z_stream *z=(z_stream *)zs;
+	inflateReset(z);
+	z->avail_in=0;
+	coff=0;
+	zend=false;
+	base=0;
+	setg(NULL, NULL, NULL);
+	return true;
+
+}
+
+gz_streambuf::int_type gz_streambuf::underflow()
+{
+	while (gptr()>=egptr())
+	{
+		bool more=(format==GZ_BGZF) ? fill_bgzf() : fill_plain();
+		if (!more){ return traits_type::eof(); }
+	}
+	return traits_type::to_int_type(*gptr());
+
+}
+
+// Note: BGZF streams move to the block holding pos, gzip streams 
+// decompress up to pos, from their start when going back. Positions past
+// the end give the end.
+gz_streambuf::pos_type gz_streambuf::seekpos(pos_type pos, ios_base::openmode which)
+{
+	long p=(long)(off_type)pos;
+	if (p<0){ return pos_type(off_type(-1)); }
+	if ((p<base)||(p>base+(egptr()-eback())))
+	{
+		if (format==GZ_BGZF)
+		{
+			const vector<long> &u=index->uoff;
+			long nblocks=(long)u.size()-1;
+			block=min((long)(upper_bound(u.begin(), u.end(), p)-u.begin())-1, nblocks);
+			base=u[block];
+			ramp=1;
+			setg(NULL, NULL, NULL);
+			while ((block<nblocks)&&(!fill_bgzf()));
+		}else{
+			if (p<base){ restart_plain(); }
+			while ((p>base+(egptr()-eback()))&&(fill_plain()));
+		}
+	}
+	p=min(p, base+(long)(egptr()-eback()));
+	setg(eback(), eback()+(p-base), egptr());
+	return pos_type(p);
+
+}
+
+gz_streambuf::pos_type gz_streambuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which)
+{
+	long cur=base+(gptr()-eback());
+	if (dir==ios_base::cur)
+	{
+		if (off==0){ return pos_type(cur); }
+		off+=cur;
+	}else if (dir==ios_base::end)
+	{
+		if (off!=0){ return pos_type(off_type(-1)); }
+		off=numeric_limits<long>::max();
+	}
+	return seekpos(pos_type(off), which);
+
+}
+
+input_stream::input_stream(string filename, int threads) : istream(NULL), buf(NULL)
+{
+	int format=gz_format(filename);
+	if (format==GZ_NONE)
+	{
+		filebuf *fb=new filebuf;
+		if (fb->open(filename.c_str(), ios::in)==NULL)
+		{
+			delete fb;
+			return;
+		}
+		buf=fb;
+	}else{
+		gz_streambuf *gz=new gz_streambuf(filename, format, threads);
+		if (!gz->is_open())
+		{
+			delete gz;
+			return;
+		}
+		buf=gz;
+	}
+	rdbuf(buf);
+
+}
+
+input_stream::~input_stream()
+{
+	delete buf;
+
+}
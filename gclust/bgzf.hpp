@@ -0,0 +1,79 @@
+#ifndef __BGZF_HPP__
+#define __BGZF_HPP__
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <streambuf>
+
+using namespace std;
+
+// Reading of gzip and BGZF compressed genome files. BGZF (bgzip) files are
+// gzip members of at most 64 KB, which are decompressed in parallel and
+// found from the block index <filename>.gzi, the same index bgzip -i
+// writes. Plain gzip files can only be read from their start.
+
+const int GZ_NONE = 0; // Not compressed.
+const int GZ_PLAIN = 1; // gzip.
+const int GZ_BGZF = 2; // BGZF.
+
+// Compression of filename, GZ_NONE when it can not be read.
+int gz_format(string filename);
+
+// Blocks of a BGZF file, compressed and uncompressed start offsets, with
+// the file end as the last entry.
+struct bgzf_index
+{
+	vector<long> coff, uoff;
+
+};
+
+// Uncompressed contents of a compressed file, seekable by uncompressed
+// offset.
+class gz_streambuf : public streambuf
+{
+public:
+	gz_streambuf(string filename, int format, int threads);
+	~gz_streambuf();
+	bool is_open() const { return fd>=0; }
+
+protected:
+	int_type underflow();
+	pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which);
+	pos_type seekpos(pos_type pos, ios_base::openmode which);
+
+private:
+	bool fill_bgzf();
+	bool fill_plain();
+	bool restart_plain();
+
+	int fd;
+	int format;
+	int threads;
+	const bgzf_index *index; // BGZF blocks, shared by the streams of a file.
+	long block; // Next BGZF block to decompress.
+	long ramp; // Blocks of the next batch, growing again after a seek.
+	vector<char> out; // Uncompressed bytes from offset base.
+	long base;
+	// Plain gzip state.
+	void *zs; // z_stream.
+	vector<char> in;
+	long coff; // Compressed bytes read.
+	bool zend; // Input exhausted.
+
+};
+
+// Input stream of a genome file, plain or compressed.
+class input_stream : public istream
+{
+public:
+	input_stream(string filename, int threads = 1);
+	~input_stream();
+	bool is_open() const { return buf!=NULL; }
+
+private:
+	streambuf *buf;
+
+};
+
+#endif
@@ -0,0 +1,612 @@
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include "extend.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XDROP_X86
+#endif
+
+// Note: seqan adds on plain int and lets -infinity plus a mismatch wrap
+// around, wrap explicitly so the scores stay bit-identical.
+static inline int wadd(int a, int b)
+{
+	return (int)((unsigned)a+(unsigned)b);
+}
+
+static inline int imax(int a, int b)
+{
+	return (a > b) ? a : b;
+}
+
+// One anti-diagonal row of the gapped extension, cells lo..hi.
+// The x code of cell i is px[i] (px[-i] reversed), the y code py[-i]
+// (py[i] reversed). Returns the running maximum.
+typedef int (*xdrop_row_fn)(int *d3, const int *d2, const int *d1,
+														long lo, long hi, const char *px, const char *py,
+														bool reverse, int mas, int umas, int gap,
+														int thr, int inf, int tmax);
+
+static int xdrop_row_scalar(int *d3, const int *d2, const int *d1,
+														long lo, long hi, const char *px, const char *py,
+														bool reverse, int mas, int umas, int gap,
+														int thr, int inf, int tmax)
+{
+	for (long i=lo; i<=hi; i++)
+	{
+		char xc = reverse ? px[-i] : px[i];
+		char yc = reverse ? py[i] : py[-i];
+		int tmp = wadd(imax(d2[i-1], d2[i]), gap);
+		tmp = imax(tmp, wadd(d1[i-1], (xc == yc) ? mas : umas));
+		tmax = imax(tmax, tmp);
+		d3[i] = (tmp < thr) ? inf : tmp;
+	}
+	return tmax;
+}
+
+#ifdef XDROP_X86
+
+// Codes of cells i..i+3 in cell order.
+static inline uint32_t codes4(const char *p, long i, bool down)
+{
+	uint32_t w;
+	if (down)
+	{
+		memcpy(&w, p-i-3, 4);
+		return __builtin_bswap32(w);
+	}
+	memcpy(&w, p+i, 4);
+	return w;
+}
+
+// Codes of cells i..i+7 in cell order.
+static inline uint64_t codes8(const char *p, long i, bool down)
+{
+	uint64_t w;
+	if (down)
+	{
+		memcpy(&w, p-i-7, 8);
+		return __builtin_bswap64(w);
+	}
+	memcpy(&w, p+i, 8);
+	return w;
+}
+
+__attribute__((target("sse4.1")))
+static int xdrop_row_sse4(int *d3, const int *d2, const int *d1,
+													long lo, long hi, const char *px, const char *py,
+													bool reverse, int mas, int umas, int gap,
+													int thr, int inf, int tmax)
+{
+	__m128i vmas = _mm_set1_epi32(mas);
+	__m128i vumas = _mm_set1_epi32(umas);
+	__m128i vgap = _mm_set1_epi32(gap);
+	__m128i vthr = _mm_set1_epi32(thr);
+	__m128i vinf = _mm_set1_epi32(inf);
+	__m128i vmax = _mm_set1_epi32(tmax);
+	long i=lo;
+	for (; i+3<=hi; i+=4)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(d2+i-1));
+		__m128i b = _mm_loadu_si128((const __m128i *)(d2+i));
+		__m128i c = _mm_loadu_si128((const __m128i *)(d1+i-1));
+		__m128i xv = _mm_cvtsi32_si128((int)codes4(px, i, reverse));
+		__m128i yv = _mm_cvtsi32_si128((int)codes4(py, i, !reverse));
+		__m128i eq = _mm_cvtepi8_epi32(_mm_cmpeq_epi8(xv, yv));
+		__m128i s = _mm_blendv_epi8(vumas, vmas, eq);
+		__m128i tmp = _mm_max_epi32(_mm_add_epi32(_mm_max_epi32(a, b), vgap),
+																_mm_add_epi32(c, s));
+		vmax = _mm_max_epi32(vmax, tmp);
+		tmp = _mm_blendv_epi8(tmp, vinf, _mm_cmpgt_epi32(vthr, tmp));
+		_mm_storeu_si128((__m128i *)(d3+i), tmp);
+	}
+	vmax = _mm_max_epi32(vmax, _mm_shuffle_epi32(vmax, 0x4e));
+	vmax = _mm_max_epi32(vmax, _mm_shuffle_epi32(vmax, 0xb1));
+	tmax = _mm_cvtsi128_si32(vmax);
+	return xdrop_row_scalar(d3, d2, d1, i, hi, px, py, reverse, mas, umas, gap,
+													thr, inf, tmax);
+}
+
+__attribute__((target("avx2")))
+static int xdrop_row_avx2(int *d3, const int *d2, const int *d1,
+													long lo, long hi, const char *px, const char *py,
+													bool reverse, int mas, int umas, int gap,
+													int thr, int inf, int tmax)
+{
+	__m256i vmas = _mm256_set1_epi32(mas);
+	__m256i vumas = _mm256_set1_epi32(umas);
+	__m256i vgap = _mm256_set1_epi32(gap);
+	__m256i vthr = _mm256_set1_epi32(thr);
+	__m256i vinf = _mm256_set1_epi32(inf);
+	__m256i vmax = _mm256_set1_epi32(tmax);
+	long i=lo;
+	for (; i+7<=hi; i+=8)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(d2+i-1));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(d2+i));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(d1+i-1));
+		__m128i xv = _mm_cvtsi64_si128((long long)codes8(px, i, reverse));
+		__m128i yv = _mm_cvtsi64_si128((long long)codes8(py, i, !reverse));
+		__m256i eq = _mm256_cvtepi8_epi32(_mm_cmpeq_epi8(xv, yv));
+		__m256i s = _mm256_blendv_epi8(vumas, vmas, eq);
+		__m256i tmp = _mm256_max_epi32(_mm256_add_epi32(_mm256_max_epi32(a, b), vgap),
+																	 _mm256_add_epi32(c, s));
+		vmax = _mm256_max_epi32(vmax, tmp);
+		tmp = _mm256_blendv_epi8(tmp, vinf, _mm256_cmpgt_epi32(vthr, tmp));
+		_mm256_storeu_si256((__m256i *)(d3+i), tmp);
+	}
+	__m128i m = _mm_max_epi32(_mm256_castsi256_si128(vmax),
+														_mm256_extracti128_si256(vmax, 1));
+	m = _mm_max_epi32(m, _mm_shuffle_epi32(m, 0x4e));
+	m = _mm_max_epi32(m, _mm_shuffle_epi32(m, 0xb1));
+	tmax = _mm_cvtsi128_si32(m);
+	return xdrop_row_scalar(d3, d2, d1, i, hi, px, py, reverse, mas, umas, gap,
+													thr, inf, tmax);
+}
+
+#endif
+
+// Pick the widest row kernel the CPU supports.
+static xdrop_row_fn xdrop_row_select()
+{
+#ifdef XDROP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return xdrop_row_avx2;
+	if (__builtin_cpu_supports("sse4.1")) return xdrop_row_sse4;
+#endif
+	return xdrop_row_scalar;
+}
+
+static xdrop_row_fn xdrop_row = xdrop_row_select();
+
+long xdrop_ungapped(const char *x,
+										const char *y,
+										long n,
+										int step,
+										int mas,
+										int umas,
+										int drops)
+{
+	int tmpScore = 0;
+	long last = 0;
+	long p = 0;
+	uint64_t wx, wy;
+
+	while ((tmpScore > -drops) && (p < n))
+	{
+		// Skip runs of 8 matching bases at once, the score only rises there.
+		if (mas > 0)
+		{
+			while (p+8 <= n)
+			{
+				if (step > 0)
+				{
+					memcpy(&wx, x+p, 8);
+					memcpy(&wy, y+p, 8);
+				}else{
+					memcpy(&wx, x-p-7, 8);
+					memcpy(&wy, y-p-7, 8);
+				}
+				if (wx != wy) break;
+				tmpScore += 8*mas;
+				if (tmpScore > 0) tmpScore = 0;
+				last = 0;
+				p += 8;
+			}
+			if (p >= n) break;
+		}
+
+		if (x[step*p] == y[step*p])
+		{
+			last = 0;
+			tmpScore += mas;
+			if (tmpScore > 0) tmpScore = 0;
+		}else{
+			tmpScore += umas;
+			++last;
+		}
+		++p;
+	}
+
+	return p-last;
+}
+
+void pack_codes(ext_seq &seq)
+{
+	long n=(long)seq.codes.size();
+	seq.words.assign(n/32+2, 0);
+	for (long i=0; i<n; i++)
+	{
+		seq.words[i/32] |= (uint64_t)(seq.codes[i]&3) << (2*(i%32));
+	}
+}
+
+#ifdef XDROP_X86
+
+// Eight walks at a time. Each lane gathers the 4 bytes around its position
+// (clamped inside the sequence) and takes up to 4 steps from them.
+__attribute__((target("avx2")))
+static void xdrop_batch_avx2(const char *x,
+														 long xlen,
+														 const char *y,
+														 long ylen,
+														 xdrop_lane *lanes,
+														 int step,
+														 int mas,
+														 int umas,
+														 int drops)
+{
+	int xs[8], ys[8], ns[8], res[8];
+	for (int j=0; j<8; j++)
+	{
+		xs[j] = (int)lanes[j].xpos;
+		ys[j] = (int)lanes[j].ypos;
+		ns[j] = (int)lanes[j].n;
+	}
+	__m256i vxs = _mm256_loadu_si256((const __m256i *)xs);
+	__m256i vys = _mm256_loadu_si256((const __m256i *)ys);
+	__m256i vn = _mm256_loadu_si256((const __m256i *)ns);
+	__m256i vxmax = _mm256_set1_epi32((int)xlen-4);
+	__m256i vymax = _mm256_set1_epi32((int)ylen-4);
+	__m256i vzero = _mm256_setzero_si256();
+	__m256i vone = _mm256_set1_epi32(1);
+	__m256i vthree = _mm256_set1_epi32(3);
+	__m256i vbyte = _mm256_set1_epi32(0xFF);
+	__m256i vmas = _mm256_set1_epi32(mas);
+	__m256i vumas = _mm256_set1_epi32(umas);
+	__m256i vdrop = _mm256_set1_epi32(-drops);
+	__m256i vp = vzero, vtmp = vzero, vlast = vzero;
+
+	while (true)
+	{
+		__m256i act = _mm256_and_si256(_mm256_cmpgt_epi32(vtmp, vdrop), 
+																	 _mm256_cmpgt_epi32(vn, vp));
+		if (_mm256_movemask_epi8(act) == 0) break;
+
+		__m256i xo, yo, xc, yc;
+		if (step > 0)
+		{
+			xo = _mm256_add_epi32(vxs, vp);
+			yo = _mm256_add_epi32(vys, vp);
+			xc = _mm256_min_epi32(xo, vxmax);
+			yc = _mm256_min_epi32(yo, vymax);
+		}else{
+			xo = _mm256_sub_epi32(vxs, vp);
+			yo = _mm256_sub_epi32(vys, vp);
+			xc = _mm256_max_epi32(_mm256_sub_epi32(xo, vthree), vzero);
+			yc = _mm256_max_epi32(_mm256_sub_epi32(yo, vthree), vzero);
+		}
+		__m256i gx = _mm256_i32gather_epi32((const int *)x, xc, 1);
+		__m256i gy = _mm256_i32gather_epi32((const int *)y, yc, 1);
+		// byte index of the current position inside the gathered words
+		__m256i ix = _mm256_slli_epi32(_mm256_sub_epi32(xo, xc), 3);
+		__m256i iy = _mm256_slli_epi32(_mm256_sub_epi32(yo, yc), 3);
+		__m256i vstep = _mm256_set1_epi32(8*step);
+
+		for (int t=0; t<4; t++)
+		{
+			__m256i cx = _mm256_and_si256(_mm256_srlv_epi32(gx, ix), vbyte);
+			__m256i cy = _mm256_and_si256(_mm256_srlv_epi32(gy, iy), vbyte);
+			act = _mm256_and_si256(_mm256_cmpgt_epi32(vtmp, vdrop), 
+														 _mm256_cmpgt_epi32(vn, vp));
+			__m256i eq = _mm256_cmpeq_epi32(cx, cy);
+			__m256i tmatch = _mm256_min_epi32(_mm256_add_epi32(vtmp, vmas), vzero);
+			__m256i tmism = _mm256_add_epi32(vtmp, vumas);
+			__m256i ntmp = _mm256_blendv_epi8(tmism, tmatch, eq);
+			__m256i nlast = _mm256_andnot_si256(eq, _mm256_add_epi32(vlast, vone));
+			vtmp = _mm256_blendv_epi8(vtmp, ntmp, act);
+			vlast = _mm256_blendv_epi8(vlast, nlast, act);
+			vp = _mm256_add_epi32(vp, _mm256_and_si256(act, vone));
+			ix = _mm256_add_epi32(ix, vstep);
+			iy = _mm256_add_epi32(iy, vstep);
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *)res, _mm256_sub_epi32(vp, vlast));
+	for (int j=0; j<8; j++) lanes[j].ext = res[j];
+}
+
+#endif
+
+void xdrop_ungapped_batch(const char *x,
+													long xlen,
+													const char *y,
+													long ylen,
+													xdrop_lane *lanes,
+													long nlanes,
+													int step,
+													int mas,
+													int umas,
+													int drops)
+{
+	long j=0;
+#ifdef XDROP_X86
+	static bool avx2 = __builtin_cpu_supports("avx2");
+	// gathers read 4 bytes and offsets are 32-bit
+	if ((avx2)&&(xlen >= 4)&&(ylen >= 4)&&(xlen < INT_MAX)&&(ylen < INT_MAX))
+	{
+		xdrop_lane pad[8];
+		for (; j<nlanes; j+=8)
+		{
+			long cnt = (nlanes-j < 8) ? nlanes-j : 8;
+			xdrop_lane *batch = lanes+j;
+			if (cnt < 8)
+			{
+				for (long k=0; k<8; k++)
+				{
+					if (k < cnt){ pad[k] = lanes[j+k]; }
+					else{ pad[k].xpos = pad[k].ypos = pad[k].n = 0; }
+				}
+				batch = pad;
+			}
+			xdrop_batch_avx2(x, xlen, y, ylen, batch, step, mas, umas, drops);
+			if (cnt < 8)
+			{
+				for (long k=0; k<cnt; k++) lanes[j+k].ext = pad[k].ext;
+			}
+		}
+	}
+#endif
+	for (; j<nlanes; j++)
+	{
+		lanes[j].ext = xdrop_ungapped(x+lanes[j].xpos, y+lanes[j].ypos, lanes[j].n, step, 
+																	mas, umas, drops);
+	}
+}
+
+// 32 bases from base q on, base q+t at bits 2t. Bases before 0 read as 0.
+static inline uint64_t packed_at(const uint64_t *w, long q)
+{
+	if (q < 0)
+	{
+		if (q <= -32) return 0;
+		return w[0] << (2*(-q));
+	}
+	long j = q/32;
+	int s = 2*(q%32);
+	if (s == 0) return w[j];
+	return (w[j] >> s) | (w[j+1] << (64-s));
+}
+
+// Reverse the order of the 32 bases of a word.
+static inline uint64_t reverse_bases(uint64_t v)
+{
+	v = __builtin_bswap64(v);
+	v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+	return v;
+}
+
+long xdrop_ungapped_packed(const uint64_t *x,
+													 long xpos,
+													 const uint64_t *y,
+													 long ypos,
+													 long n,
+													 int step,
+													 int mas,
+													 int umas,
+													 int drops)
+{
+	int tmpScore = 0;
+	long last = 0;
+	long p = 0;
+
+	if (!(tmpScore > -drops)) return 0;
+
+	while (p < n)
+	{
+		long cnt = (n-p < 32) ? n-p : 32;
+		uint64_t wx, wy;
+		if (step > 0)
+		{
+			wx = packed_at(x, xpos+p);
+			wy = packed_at(y, ypos+p);
+		}else{
+			wx = reverse_bases(packed_at(x, xpos-p-31));
+			wy = reverse_bases(packed_at(y, ypos-p-31));
+		}
+		// One bit per mismatching base, in walk order.
+		uint64_t diff = wx ^ wy;
+		uint64_t mism = (diff | (diff >> 1)) & 0x5555555555555555ULL;
+		if (cnt < 32) mism &= (1ULL << (2*cnt)) - 1;
+
+		if ((mas > 0) && (__builtin_popcountll(mism) == 0))
+		{
+			tmpScore += cnt*mas;
+			if (tmpScore > 0) tmpScore = 0;
+			last = 0;
+			p += cnt;
+			continue;
+		}
+
+		long t0 = 0;
+		while ((mism != 0) || (t0 < cnt))
+		{
+			// matches up to the next mismatch (or the end of the word)
+			long t = (mism != 0) ? (__builtin_ctzll(mism) >> 1) : cnt;
+			if (mas > 0)
+			{
+				if (t > t0)
+				{
+					tmpScore += (t-t0)*mas;
+					if (tmpScore > 0) tmpScore = 0;
+					last = 0;
+					p += t-t0;
+				}
+			}else{
+				// the score can fall on matches too, one base at a time
+				for (long j=t0; j<t; j++)
+				{
+					last = 0;
+					tmpScore += mas;
+					if (tmpScore > 0) tmpScore = 0;
+					++p;
+					if (!(tmpScore > -drops)) return p-last;
+				}
+			}
+			if (mism == 0) break;
+			tmpScore += umas;
+			++last;
+			++p;
+			if (!(tmpScore > -drops)) return p-last;
+			mism &= mism-1;
+			t0 = t+1;
+		}
+	}
+
+	return p-last;
+}
+
+long xdrop_gapped(const char *x,
+									long xlen,
+									const char *y,
+									long ylen,
+									bool reverse,
+									int mas,
+									int umas,
+									int gap,
+									int drops,
+									xdrop_buf &buf)
+{
+	if ((xlen <= 0) || (ylen <= 0)) return 0;
+
+	int inf = wadd(INT_MIN+1, -gap);
+	const char *px, *py;
+
+	// Three rotating anti-diagonals. Only the cells written last time
+	// (the row band and both borders) are reset, cells beyond a diagonal's
+	// length have never been written, so the work follows the X-drop band
+	// instead of the window length.
+	int *d[3];
+	long len[3], wlo[3], whi[3];
+	for (int j=0; j<3; j++)
+	{
+		if ((long)buf.diag[j].size() < xlen+4) buf.diag[j].resize(xlen+4);
+		d[j] = &buf.diag[j][0];
+		wlo[j] = 1;
+		whi[j] = 0;
+	}
+	int p1=0, p2=1, p3=2;
+
+	len[p1] = 1;
+	len[p2] = 2;
+	len[p3] = (xlen+1 < 3) ? xlen+1 : 3;
+	d[p1][0] = 0;
+	d[p2][0] = d[p2][1] = inf;
+	for (long j=0; j<3; j++) d[p3][j] = inf;
+
+	if (gap >= -drops)
+	{
+		d[p2][0] = gap;
+		d[p2][1] = gap;
+	}
+	if (2*gap >= -drops)
+	{
+		d[p3][0] = 2*gap;
+		d[p3][2] = 2*gap;
+	}
+
+	long b = 1; // lower bound for i
+	long u = 0; // upper bound for i
+	long k = 1; // current antidiagonal
+	int tmpMax1 = 0; // maximum score without the current diagonal
+	int tmpMax2 = 0; // maximum score including the current diagonal
+
+	while (true)
+	{
+		++k;
+		if (reverse)
+		{
+			px = x+xlen;
+			py = y+ylen-k;
+		}else{
+			px = x-1;
+			py = y+k-1;
+		}
+		if (b <= u+1)
+		{
+			tmpMax2 = xdrop_row(d[p3], d[p2], d[p1], b, u+1, px, py, reverse,
+													mas, umas, gap, tmpMax1-drops, inf, tmpMax2);
+		}
+		wlo[p3] = b;
+		whi[p3] = u+1;
+
+		// narrow the relevant matrix region
+		while ((b < len[p3]-1) && (d[p3][b] == inf) && (d[p2][b-1] == inf)) ++b;
+		++u;
+		while ((u >= 0) && (d[p3][u] == inf) && (d[p2][u] == inf)) --u;
+
+		// borders for lower triangle of edit matrix
+		if (b < k+1-ylen) b = k+1-ylen;
+		if (u > xlen-1) u = xlen-1;
+
+		if (b > u+1) break;
+
+		// swap diagonals
+		int pt = p1;
+		p1 = p2;
+		p2 = p3;
+		p3 = pt;
+
+		// reuse the oldest diagonal as the new longest one
+		int *d3 = d[p3];
+		long oldlen = len[p3];
+		long newlen = (oldlen+3 < xlen+1) ? oldlen+3 : xlen+1;
+		if (newlen < oldlen) newlen = oldlen;
+		for (long j=wlo[p3]; j<=whi[p3]; j++) d3[j] = inf;
+		d3[0] = inf;
+		d3[oldlen-1] = inf;
+		for (long j=oldlen; j<newlen; j++) d3[j] = inf;
+		len[p3] = newlen;
+		wlo[p3] = 1;
+		whi[p3] = 0;
+
+		int border = wadd(d[p2][0], gap);
+		if (border >= tmpMax1-drops) d3[0] = border;
+		border = wadd(d[p2][len[p2]-1], gap);
+		if (border >= tmpMax1-drops) d3[newlen-1] = border;
+
+		tmpMax1 = tmpMax2;
+	}
+
+	// Find seed start/end
+	long extLengthDatabase = 0;
+	int tmpMax = inf;
+	int *d1 = d[p1];
+	int *d2 = d[p2];
+	if ((k >= xlen+ylen) && (d2[u+1] >= tmpMax1-drops))
+	{
+		// extension ends at end of both sequences
+		extLengthDatabase = ylen;
+		tmpMax = d2[u+1];
+	}else if ((b >= xlen) && (b < len[p2]) && (d2[b] >= tmpMax1-drops)){
+		// extension ends at end of query
+		tmpMax = d2[b];
+		extLengthDatabase = k-(xlen+1);
+	}else if ((k-u-1 >= ylen) && (u >= 0) && (d2[u] >= tmpMax1-drops)){
+		// extension ends at end of database
+		tmpMax = d2[u];
+		extLengthDatabase = ylen;
+	}else{
+		// extension ends with mismatch, only the borders and the last band
+		// of the diagonal can be finite
+		long last = len[p1]-1;
+		for (long eu=0; eu<=last; eu++)
+		{
+			if ((eu > 0) && (eu < wlo[p1])) eu = wlo[p1];
+			if ((eu > whi[p1]) && (eu < last)) eu = last;
+			if (eu > last) break;
+			if (d1[eu] > tmpMax)
+			{
+				tmpMax = d1[eu];
+				extLengthDatabase = k-(eu+2);
+				if (extLengthDatabase > ylen) extLengthDatabase = ylen;
+			}
+		}
+	}
+
+	if (tmpMax != inf) return extLengthDatabase;
+	return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef __EXTEND_HPP__
+#define __EXTEND_HPP__
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+// X-drop seed extension on 2-bit base codes (one code per byte).
+// Both kernels reproduce seqan's extendSeed exactly, so -ext 1/2 give the
+// same extension lengths as before; they only avoid its generic String
+// and Infix machinery and vectorize the anti-diagonal of the gapped case.
+
+// Sequence for extension: base codes and, for -ext 3, the same codes
+// packed 32 per word (base i at bits 2*(i%32) of word i/32) followed by
+// one zero word.
+struct ext_seq
+{
+	string codes;
+	vector<uint64_t> words;
+
+};
+
+// Pack the base codes of seq into its words.
+void pack_codes(ext_seq &seq);
+
+// Anti-diagonals of the gapped kernel, kept per thread.
+struct xdrop_buf
+{
+	vector<int> diag[3];
+
+};
+
+// Ungapped X-drop walk from x/y over at most n bases, step +1 or -1.
+// Returns the number of bases extended.
+long xdrop_ungapped(const char *x,
+										const char *y,
+										long n,
+										int step,
+										int mas,
+										int umas,
+										int drops);
+
+// One pending ungapped extension: walk from x[xpos]/y[ypos] over at most
+// n bases, ext receives the extension length.
+struct xdrop_lane
+{
+	long xpos, ypos, n;
+	long ext;
+
+};
+
+const int XDROP_LANES = 8; // Gaps extended together.
+
+// Ungapped walks of several gaps of the same sequences and direction, one
+// gap per SIMD lane.
+void xdrop_ungapped_batch(const char *x,
+													long xlen,
+													const char *y,
+													long ylen,
+													xdrop_lane *lanes,
+													long nlanes,
+													int step,
+													int mas,
+													int umas,
+													int drops);
+
+// Same walk on packed words from base xpos/ypos, a whole word of bases
+// per step, only mismatching bases are visited one by one.
+long xdrop_ungapped_packed(const uint64_t *x,
+													 long xpos,
+													 const uint64_t *y,
+													 long ypos,
+													 long n,
+													 int step,
+													 int mas,
+													 int umas,
+													 int drops);
+
+// Gapped X-drop extension (Zhang et al.) of x[0..xlen) against
+// y[0..ylen), right to left when reverse is set.
+// Returns the extension length on y.
+long xdrop_gapped(const char *x,
+									long xlen,
+									const char *y,
+									long ylen,
+									bool reverse,
+									int mas,
+									int umas,
+									int gap,
+									int drops,
+									xdrop_buf &buf);
+
+#endif
@@ -1,7 +1,17 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <utility>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "fasta.hpp"
+#include "bgzf.hpp"
 
 // Filter 'n' in genome.
 void filter_n(string &seq_rc) 
@@ -73,6 +83,39 @@ void trim(string &line, long &start, long &end)
   }
 }
 
+// Note: one line of the input as every reader normalizes it. A header
+// names the genome from the first non space after '>' up to the next 
+// space. A sequence line is trimmed of spaces at both ends, a line of 
+// spaces only is kept whole, and is appended lowercased to cont when 
+// given: one copy of the line and a branch free pass the compiler 
+// vectorizes. Returns the sequence length of the line, 0 for a header.
+static long fasta_line(const char *line, long len, string &meta, string *cont)
+{
+	long start, end;
+	if ((len>0)&&(line[0]=='>'))
+	{
+		for (start=1; (start<len)&&(line[start]==' '); start++);
+		for (end=start; (end<len)&&(line[end]!=' '); end++);
+		meta.assign(line+start, end-start);
+		return 0;
+	}
+	for (start=0; (start<len)&&(line[start]==' '); start++);
+	for (end=len; (end>start)&&(line[end-1]==' '); end--);
+	if (start==end){ start=0; end=len; }
+	if (cont!=NULL)
+	{
+		long at=cont->size(), n=end-start;
+		cont->append(line+start, n);
+		char *p=&(*cont)[0]+at;
+		for (long i=0; i<n; i++)
+		{
+			p[i]=((unsigned char)(p[i]-'A')<26) ? p[i]+('a'-'A') : p[i];
+		}
+	}
+	return end-start;
+
+}
+
 // load data.
 void load_fasta(string filename, 
 								string &S, 
@@ -84,7 +127,7 @@ void load_fasta(string filename,
 
   // Everything starts at zero.
   startpos.push_back(0);
-  ifstream data(filename.c_str());
+  input_stream data(filename);
   if(!data.is_open()) { 
 		cerr << "unable to open " << filename << endl; 
 		exit(1); 
@@ -132,6 +175,75 @@ void load_fasta(string filename,
 
 }
 
+// Read the genome at info.offset into tg. pos is the offset of the next
+// line of data, the stream only seeks when the genome does not follow
+// the one read before.
+static void read_genome(istream &data, 
+												long &pos, 
+												GenomeClustInfo &info, 
+												Genome &tg)
+{
+	string line, meta;
+	if (pos!=info.offset)
+	{
+		data.clear();
+		data.seekg(info.offset);
+		pos=info.offset;
+	}
+	tg.cont.clear();
+	tg.cont.reserve(info.size);
+	// Meta data, then sequence data up to the next header.
+	getline(data, line);
+	pos+=line.length()+1;
+	fasta_line(line.data(), line.length(), meta, &tg.cont);
+	while((data.peek()!='>')&&(!data.eof())) {
+		getline(data, line); // Load one line at a time.
+		pos+=line.length()+1;
+		fasta_line(line.data(), line.length(), meta, &tg.cont);
+	}
+	tg.descript=meta;
+	tg.id=info.id;
+	tg.size=tg.cont.length();
+	tg.view=NULL;
+
+}
+
+// Order genome indexes by offset in the input.
+struct offset_less
+{
+	vector<GenomeClustInfo> &genomes;
+	offset_less(vector<GenomeClustInfo> &genomes_) : genomes(genomes_) {}
+	bool operator() (long a, long b) const { return genomes[a].offset < genomes[b].offset; }
+
+};
+
+// Note: read the genomes [first, last) into partgenomes, each at its 
+// place, in the order of their offsets. The genomes of an unsorted input
+// are scattered over it, so the input is still read forward once, a
+// compressed one is not decompressed again for every genome.
+static void read_genomes(string filename, 
+												 vector<Genome> &partgenomes,
+												 vector<GenomeClustInfo> &totalgenomes,
+												 long first,
+												 long last)
+{
+	long pos=-1, at=partgenomes.size();
+	vector<long> order;
+	for (long id=first; id<last; id++){ order.push_back(id); }
+	stable_sort(order.begin(), order.end(), offset_less(totalgenomes));
+  input_stream data(filename);
+  if(!data.is_open()) { 
+		cerr << "unable to open " << filename << endl; 
+		exit(1); 
+	}
+	partgenomes.resize(at+last-first);
+	for (long k=0; k<(long)order.size(); k++)
+	{
+		read_genome(data, pos, totalgenomes[order[k]], partgenomes[at+order[k]-first]);
+	}
+
+}
+
 // Load part genomes of total for clustering.
 // Previous genomes have been processed need to skip.
 void load_part_genomes(string filename, 
@@ -140,84 +252,20 @@ void load_part_genomes(string filename,
 											 long previous, 
 											 long number)
 {
-	string meta, line, S;
-  long length = 0;
+	long last=min(previous+number, (long)totalgenomes.size());
+	read_genomes(filename, partgenomes, totalgenomes, previous, last);
+
+}
+
+// View of a genome held in memory, sharing its content.
+static Genome genome_view(const Genome &g)
+{
 	Genome tg;
-  ifstream data(filename.c_str());
-  if(!data.is_open()) { 
-		cerr << "unable to open " << filename << endl; 
-		exit(1); 
-	}
-	// Skip previous genomes.
-	long i=0;
-	while(!data.eof()) {
-		getline(data, line);
-		if(line[0] == '>') {
-			i++;
-			if (i>previous){
-				break;
-			}
-		}
-	}
-	// Genome id from previous.
-	long id=i-1; 
-	long loadnum=0;
-	// First one sequence.
-	meta = "";
-	long start = 1, end = line.length() - 1;
-	for(i = start; i <= end; i++) { 
-		if(line[i] == ' ') break; 
-		meta += line[i]; 
-	}
-	S="";
-  while(!data.eof()) {
-    getline(data, line); // Load one line at a time.
-    if(line.length() == 0) continue;
-    long start = 0, end = line.length() - 1;
-    // Meta tag line and start of a new sequence.
-    if(line[0] == '>') {
-			// Save previous sequence and meta data.
-			if(length > 0) {
-				tg.descript=meta;
-				tg.id=id++;
-				tg.size=S.length();
-				tg.cont=S;
-				partgenomes.push_back(tg);
-			  loadnum++;
-				S="";
-				// Check genomes loaded one time.
-				if (loadnum>=number){
-					break;
-				}
-      }
-      // Reset parser state.
-      start = 1; meta = ""; length = 0;
-    }
-    trim(line, start, end);
-    // Collect meta data.
-    if(line[0] == '>') {
-      for(long i = start; i <= end; i++) { 
-				if(line[i] == ' ') break; 
-				meta += line[i]; 
-			}
-    }else { // Collect sequence data.
-      length += end - start + 1;
-      for(long i = start; i <= end; i++) { 
-				S += std::tolower(line[i]);
-      }
-    }
-  }
-	// last sequence
-	if (loadnum<number){
-		if(length > 0) {
-			tg.descript=meta;
-			tg.id=id++;
-			tg.size=S.length();
-			tg.cont=S;
-			partgenomes.push_back(tg);
-			loadnum++;
-		}  
-	}
+	tg.size=g.size;
+	tg.id=g.id;
+	tg.descript=g.descript;
+	tg.view=g.seq();
+	return tg;
 
 }
 
@@ -228,12 +276,10 @@ void load_part_genomes_mem(vector<Genome> &allpartgenomes,
 													 long previous, 
 													 long number)
 {	
-	Genome tg;
 	long loadnumber=0;
 	long genomes=allpartgenomes.size();
 	for (long i=previous; i<genomes; i++){
-		tg=allpartgenomes[i];
-		partgenomes.push_back(tg);
+		partgenomes.push_back(genome_view(allpartgenomes[i]));
 		loadnumber++;
 		if (loadnumber>=number){
 			break;
@@ -242,6 +288,27 @@ void load_part_genomes_mem(vector<Genome> &allpartgenomes,
 
 }
 
+// Note: wait until the rep flag of genome id is final, for a loader 
+// running ahead of the clustering passes. The mark's lock orders the
+// flags written before it was set.
+static void wait_ready(ready_mark *ready, long id)
+{
+	if (ready==NULL){ return; }
+	pthread_mutex_lock(&ready->lock);
+	while (ready->value<=id){ pthread_cond_wait(&ready->cond, &ready->lock); }
+	pthread_mutex_unlock(&ready->lock);
+
+}
+
+void set_ready(ready_mark &mark, long value)
+{
+	pthread_mutex_lock(&mark.lock);
+	mark.value=value;
+	pthread_cond_broadcast(&mark.cond);
+	pthread_mutex_unlock(&mark.lock);
+
+}
+
 // Load genomes from file.
 void load_part_genomes_internal(string filename,
 																vector<Genome> &partgenomes,
@@ -250,106 +317,34 @@ void load_part_genomes_internal(string filename,
 																int &number, 
 																long totalsize, 
 																bool &ifend,
-																int memiden)
+																int memiden,
+																ready_mark *ready)
 {
-	string meta, line, S;
-	Genome tg;
-	long length, loadgenomes, id, loadnumber, start, end, sizeadd, stablenumber;
-	length=loadgenomes=loadnumber=sizeadd=0;
+	long loadgenomes, id, sizeadd, stablenumber;
+	long genomes=totalgenomes.size();
+	loadgenomes=sizeadd=0;
 	if (memiden==100)
 	{
 		stablenumber=MAX_PARTNUMBERFORPERFECT;
 	}else{
 		stablenumber=MAX_PARTNUMBER;
 	}
-	bool beforeend=false;
-	ifend=false;
-  ifstream data(filename.c_str());
-  if(!data.is_open()) { 
-		cerr << "unable to open " << filename << endl; 
-		exit(1); 
-	}
-	// Skip previous genomes.
-	long i=0;
-	while(!data.eof()) {
-		getline(data, line);
-		if(line[0] == '>') {
-			i++;
-			if (i>previous){ break;}
-		}
-	}
-	id=i-1; // Genome id from previous.
-
-	// First sequence.
-	meta = "";
-	start = 1; end = line.length() - 1;
-	for(i = start; i <= end; i++) { 
-		if(line[i] == ' ') break; 
-		meta += line[i]; 
-	}
-	S="";
-	while(!data.eof()) 
+	// The block ends by the sizes and rep flags, then it is read.
+	for (id=previous; id<genomes; id++)
 	{
-    getline(data, line); // Load one line at a time.
-    if(line.length() == 0) continue;
-    start = 0; end = line.length() - 1;
-    // Meta tag line and start of a new sequence.
-    if(line[0] == '>') {
-			// Save previous sequence and meta data.
-			if(length > 0) {
-				tg.descript=meta;
-				tg.id=id++;
-				tg.size=S.length();
-				tg.cont=S;
-				if (totalgenomes[tg.id].rep){
-					sizeadd+=tg.size;
-					if ((sizeadd<=totalsize)&&(loadgenomes<stablenumber)){
-						partgenomes.push_back(tg);
-						loadnumber++;
-						loadgenomes++;
-					}else{
-						beforeend=true;
-						break;
-					}
-				}else{
-					partgenomes.push_back(tg);
-					loadnumber++;
-				}
-				S="";
-			}
-      // Reset parser state.
-      start = 1; meta = ""; length = 0;
-    }
-    trim(line, start, end);
-    if(line[0] == '>') {
-      for(long i = start; i <= end; i++) { 
-				if(line[i] == ' ') break; 
-				meta += line[i]; 
+		wait_ready(ready, id);
+		if (totalgenomes[id].rep){
+			sizeadd+=totalgenomes[id].size;
+			// Note: the last genome ends the input whatever its size.
+			if (((sizeadd>totalsize)||(loadgenomes>=stablenumber))&&(id<genomes-1)){
+				break;
 			}
-    }else { // Collect sequence data.
-      length += end - start + 1;
-      for(long i = start; i <= end; i++) { 
-				S += std::tolower(line[i]);
-      }
-    }
-  }
-	// The last one
-	if(length > 0) {
-			tg.descript=meta;
-			tg.id=id++;
-			tg.size=S.length();
-			tg.cont=S;
-	}
-	if (!beforeend){
-		
-		partgenomes.push_back(tg);
-		loadnumber++;
-		if (totalgenomes[tg.id].rep){
 			loadgenomes++;
 		}
-		ifend=true;
 	}
-	number=loadnumber;
+	read_genomes(filename, partgenomes, totalgenomes, previous, id);
+	ifend=(id>=genomes);
+	number=id-previous;
 
 }
 
@@ -363,7 +358,6 @@ void load_part_genomes_internal_mem(vector<Genome> &allpartgenomes,
 																		bool &ifend,
 																		int memiden)
 {
-	Genome tg;
 	long loadnumber, loadgenomes, genomes, sizeadd, stablenumber, i;
 	loadnumber=loadgenomes=sizeadd=0;
 	genomes=allpartgenomes.size();
@@ -375,18 +369,18 @@ void load_part_genomes_internal_mem(vector<Genome> &allpartgenomes,
 	}
 	ifend=false;
 	for (i=previous; i<genomes; i++){
-		tg=allpartgenomes[i];
+		Genome &tg=allpartgenomes[i];
 		if (totalgenomes[tg.id].rep){
 			sizeadd+=tg.size;
 			if ((sizeadd<=totalsize)&&(loadgenomes<stablenumber)){
-				partgenomes.push_back(tg);
+				partgenomes.push_back(genome_view(tg));
 				loadnumber++;
 				loadgenomes++;
 			}else{
 				break;
 			}
 		}else{
-			partgenomes.push_back(tg);
+			partgenomes.push_back(genome_view(tg));
 			loadnumber++;
 		}
 	}
@@ -398,42 +392,22 @@ void load_part_genomes_internal_mem(vector<Genome> &allpartgenomes,
 }
 
 // Load all genomes same as loading part genomes
-void load_part_genomes_all(string filename, vector<Genome> &partgenomes)
+void load_part_genomes_all(string filename, vector<Genome> &partgenomes, int threads)
 {
 	string meta, line, S;
   long length = 0;
 	Genome tg;
-  ifstream data(filename.c_str());
+  input_stream data(filename, threads);
   if(!data.is_open()) { 
 		cerr << "unable to open " << filename << endl; 
 		exit(1); 
 	}
-	// Skip previous genomes.
-	long i=0;
-	while(!data.eof()) {
-		getline(data, line);
-		if(line[0] == '>') {
-			i++;
-			if (i>0){
-				break;
-			}
-		}
-	}
-	// Genome id from previous.
+	// Genome id as in scan_total_genomes.
 	long id=0;
 	long loadnum=0;
-	// First one sequence.
-	meta = "";
-	long start = 1, end = line.length() - 1;
-	for(i = start; i <= end; i++) { 
-		if(line[i] == ' ') break; 
-		meta += line[i]; 
-	}
-	S="";
   while(!data.eof()) {
     getline(data, line); // Load one line at a time.
     if(line.length() == 0) continue;
-    long start = 0, end = line.length() - 1;
     // Meta tag line and start of a new sequence.
     if(line[0] == '>') {
 			// Save previous sequence and meta data.
@@ -441,27 +415,14 @@ void load_part_genomes_all(string filename, vector<Genome> &partgenomes)
 				tg.descript=meta;
 				tg.id=id++;
 				tg.size=S.length();
-				tg.cont=S;
-				partgenomes.push_back(tg);
+				tg.cont.swap(S);
+				partgenomes.push_back(std::move(tg));
 			  loadnum++;
 				S="";
       }
-      // Reset parser state.
-      start = 1; meta = ""; length = 0;
-    }
-    trim(line, start, end);
-    // Collect meta data.
-    if(line[0] == '>') {
-      for(long i = start; i <= end; i++) { 
-				if(line[i] == ' ') break; 
-				meta += line[i]; 
-			}
-    }else { // Collect sequence data.
-      length += end - start + 1;
-      for(long i = start; i <= end; i++) { 
-				S += std::tolower(line[i]);
-      }
+      length = 0; // Reset parser state.
     }
+    length += fasta_line(line.data(), line.length(), meta, &S);
   }
 	// last sequence
 	if(length > 0) 
@@ -469,8 +430,8 @@ void load_part_genomes_all(string filename, vector<Genome> &partgenomes)
 		tg.descript=meta;
 		tg.id=id++;
 		tg.size=S.length();
-		tg.cont=S;
-		partgenomes.push_back(tg);
+		tg.cont.swap(S);
+		partgenomes.push_back(std::move(tg));
 		loadnum++;
 	}
 
@@ -479,15 +440,14 @@ void load_part_genomes_all(string filename, vector<Genome> &partgenomes)
 //Test part genomes loading vector 
 void test_part(vector<Genome> &partgenomes)
 {
-	Genome tg;
 	int s=partgenomes.size();
 	for (int i=0;i<s;i++){	
-		tg=partgenomes[i];
+		Genome &tg=partgenomes[i];
 		cout<<"===========\n";
 		cout<<tg.descript<<endl;
 		cout<<tg.id<<endl;
 		cout<<tg.size<<endl;
-		cout<<tg.cont<<endl;
+		cout.write(tg.seq(), tg.size)<<endl;
 		cout<<"===========\n";
 	}
 }
@@ -499,24 +459,29 @@ void make_block_ref(vector<Genome> &partgenomes, string &S,
 										vector<long> &startpos)
 {
 	long pos = 0;
-	Genome tg;
 	long s=partgenomes.size();
 	S="";
+	// Size the text once, the contents are appended in place.
+	for (long i=0;i<s;i++){
+		if (totalgenomes[partgenomes[i].id].rep){ pos+=partgenomes[i].size+1; }
+	}
+	S.reserve(pos);
+	pos = 0;
 	startpos.push_back(0);
 	for (long i=0;i<s;i++){	
-		tg=partgenomes[i];
+		Genome &tg=partgenomes[i];
 		if (!totalgenomes[tg.id].rep){
 			continue;
 		}
-		S += tg.cont;
+		S.append(tg.seq(), tg.size);
 		S += '`';
 		pos = pos+tg.size+1;
 		startpos.push_back(pos);
 		descr.push_back(tg.id);
 	}
 	startpos.pop_back();
-	int k = S.length(); 
-	S = S.substr(0,k-1);
+	// Drop the last separator.
+	if (!S.empty()){ S.erase(S.length()-1); }
 	cerr<<"\n===="<<endl;
 	cerr<<"S "<<S.length()<<endl;
 	cerr<<"startpos "<<startpos.size()<<endl;
@@ -525,27 +490,85 @@ void make_block_ref(vector<Genome> &partgenomes, string &S,
 
 }
 
-// Load total genomes one time.
-void load_total_genomes(string filename, 
-												vector<GenomeClustInfo> &totalgenomes)
+// Note: the index starts with the line "#gclust <size> <mtime>" of the
+// input it was built from, then has "<length>\t<offset>\t<name>" per genome.
+static bool read_fasta_index(string filename, 
+														 vector<GenomeClustInfo> &totalgenomes)
 {
-	long length, maxlen, totallen, minlen;
-	length=maxlen=totallen=0;
-	minlen=MAX_GENOME;
-	int id, loadnum; // Genome id from previous.
-	id=loadnum=0;
+	struct stat st;
+	if (stat(filename.c_str(), &st)!=0){ return false; }
+	ifstream idx((filename+".gfi").c_str());
+	if (!idx.is_open()){ return false; }
+	string line;
+	long size, mtime;
+	getline(idx, line);
+	if ((sscanf(line.c_str(), "#gclust %ld %ld", &size, &mtime)!=2)||
+			(size!=(long)st.st_size)||(mtime!=(long)st.st_mtime)){ return false; }
+	GenomeClustInfo tg;
+	tg.rep=true;
+	while (getline(idx, line))
+	{
+		char *p;
+		tg.size=strtol(line.c_str(), &p, 10);
+		if (*p=='\t'){ tg.offset=strtol(p+1, &p, 10); }
+		if (*p!='\t')
+		{
+			totalgenomes.clear();
+			return false;
+		}
+		tg.id=totalgenomes.size();
+		tg.descript=string(p+1);
+		totalgenomes.push_back(tg);
+	}
+	return true;
+
+}
+
+// Write the index of filename, through a private file renamed into place
+// so concurrent runs never read a partial one. Unwritable places are 
+// skipped, the next run scans the input again.
+static void write_fasta_index(string filename, 
+															vector<GenomeClustInfo> &totalgenomes)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st)!=0){ return; }
+	char pid[32];
+	sprintf(pid, ".%ld", (long)getpid());
+	string name=filename+".gfi", part=name+pid;
+	ofstream idx(part.c_str());
+	if (!idx.is_open()){ return; }
+	idx<<"#gclust "<<(long)st.st_size<<" "<<(long)st.st_mtime<<"\n";
+	for (long i=0; i<(long)totalgenomes.size(); i++)
+	{
+		GenomeClustInfo &tg=totalgenomes[i];
+		idx<<tg.size<<'\t'<<tg.offset<<'\t'<<tg.descript<<'\n';
+	}
+	idx.close();
+	if ((idx.fail())||(rename(part.c_str(), name.c_str())!=0)){ unlink(part.c_str()); }
+
+}
+
+// Scan the input for the genomes and their header offsets.
+static void scan_total_genomes(string filename, 
+															 vector<GenomeClustInfo> &totalgenomes,
+															 int threads)
+{
+	long length, pos, head;
+	length=pos=head=0;
+	int id=0; // Genome id from previous.
 	string meta, line;
 	GenomeClustInfo tg;
   // Everything starts at zero.
-  ifstream data(filename.c_str());
+  input_stream data(filename, threads);
   if(!data.is_open()) { 
 		cerr << "unable to open " << filename << endl; 
 		exit(1); 
 	}
   while(!data.eof()) {
+		long here=pos;
     getline(data, line); // Load one line at a time.
+		pos+=line.length()+1;
     if(line.length() == 0) continue;
-    long start = 0, end = line.length() - 1;
     if(line[0] == '>') { // Meta tag line and start of a new sequence.
 			if(length > 0) { // Save previous sequence and meta data.
 				tg.descript=meta;
@@ -553,24 +576,14 @@ void load_total_genomes(string filename,
 				//tg.pid=id;
 				tg.rep=true;
 				tg.size=length;
-				totallen+=length;
+				tg.offset=head;
 				totalgenomes.push_back(tg);
-				if (length>maxlen){	maxlen=length; }
-				if (length<minlen){ minlen=length; }
 				id++;
-				loadnum++;
       }
-      start = 1; meta = ""; length = 0; // Reset parser state.
-    }
-    trim(line, start, end);
-    if(line[0] == '>') { // Collect meta data.
-      for(long i = start; i <= end; i++) { 
-				if(line[i] == ' ') break; 
-				meta += line[i];
-			}
-    }else { // Collect sequence data.
-      length += end - start + 1;
+      length = 0; // Reset parser state.
+			head=here;
     }
+    length += fasta_line(line.data(), line.length(), meta, NULL);
   }
 	
 	if(length > 0) { // Last one.
@@ -578,12 +591,224 @@ void load_total_genomes(string filename,
 		tg.id=id;
 		tg.rep=true;
 		tg.size=length;
+		tg.offset=head;
 		totalgenomes.push_back(tg);
+		id++;
+	}
+
+}
+
+// One record of the mapped input: the header line at head, or the lines
+// before the first header when head is -1, up to end.
+struct fasta_record
+{
+	long head, begin, end;
+	long length;
+	string meta, cont;
+
+};
+
+// Shared state of the parallel scan.
+struct fasta_scan
+{
+	const char *data;
+	long size;
+	int threads;
+	bool contents; // Keep the normalized contents, else only the lengths.
+	vector< vector<long> > heads; // Header offsets found per thread.
+	vector<fasta_record> records;
+	long next; // Next record to parse.
+
+};
+
+struct scan_arg
+{
+	fasta_scan *scan;
+	int part;
+
+};
+
+// Find the header lines starting in one byte range of the input.
+static void *scan_heads(void *arg_)
+{
+	scan_arg *arg=(scan_arg *)arg_;
+	fasta_scan &scan=*arg->scan;
+	long lo=scan.size/scan.threads*arg->part;
+	long hi=(arg->part==scan.threads-1) ? scan.size : scan.size/scan.threads*(arg->part+1);
+	vector<long> &heads=scan.heads[arg->part];
+	const char *p=scan.data+lo, *last=scan.data+hi;
+	// Note: memchr scans a vector of bytes per step, '>' is rare outside
+	// of headers.
+	while ((p<last)&&((p=(const char *)memchr(p, '>', last-p))!=NULL))
+	{
+		if ((p==scan.data)||(p[-1]=='\n')){ heads.push_back(p-scan.data); }
+		p++;
+	}
+	return NULL;
+
+}
+
+// Parse one record, lines are found with memchr and normalized as the
+// serial readers do.
+static void parse_record(const char *data, fasta_record &rec, bool contents)
+{
+	long ls=rec.begin;
+	rec.length=0;
+	if (contents){ rec.cont.reserve(rec.end-rec.begin); }
+	while (ls<rec.end)
+	{
+		const char *nl=(const char *)memchr(data+ls, '\n', rec.end-ls);
+		long le=(nl!=NULL) ? nl-data : rec.end;
+		rec.length+=fasta_line(data+ls, le-ls, rec.meta, (contents) ? &rec.cont : NULL);
+		ls=le+1;
+	}
+
+}
+
+// Parse the records claimed from the shared counter.
+static void *scan_records(void *arg_)
+{
+	fasta_scan &scan=*((scan_arg *)arg_)->scan;
+	long total=(long)scan.records.size();
+	while (1)
+	{
+		long r=__sync_fetch_and_add(&scan.next, 1);
+		if (r>=total){ break; }
+		parse_record(scan.data, scan.records[r], scan.contents);
+	}
+	return NULL;
+
+}
+
+// Run one step of the scan on threads and wait for them.
+static void scan_run(fasta_scan &scan, void *(*step)(void *))
+{
+	vector<pthread_t> ids(scan.threads);
+	vector<scan_arg> args(scan.threads);
+	for (int t=0; t<scan.threads; t++)
+	{
+		args[t].scan=&scan;
+		args[t].part=t;
+		pthread_create(&ids[t], NULL, step, &args[t]);
+	}
+	for (int t=0; t<scan.threads; t++){ pthread_join(ids[t], NULL); }
+
+}
+
+// Scan the mapped input on threads: header lines are found in byte 
+// ranges, then the records between them are parsed, with their contents
+// into allgenomes when given. Returns false when the input can not be 
+// mapped or is compressed.
+static bool parse_fasta_parallel(string filename, 
+																 vector<GenomeClustInfo> &totalgenomes,
+																 vector<Genome> *allgenomes,
+																 int threads)
+{
+	struct stat st;
+	int fd=open(filename.c_str(), O_RDONLY);
+	if (fd<0) { 
+		cerr << "unable to open " << filename << endl; 
+		exit(1); 
+	}
+	if ((fstat(fd, &st)!=0)||(!S_ISREG(st.st_mode))||(st.st_size==0)||
+			(gz_format(filename)!=GZ_NONE))
+	{
+		close(fd);
+		return false;
+	}
+	void *p=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p==MAP_FAILED){ return false; }
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	fasta_scan scan;
+	scan.data=(const char *)p;
+	scan.size=st.st_size;
+	scan.threads=max(1, threads);
+	scan.contents=(allgenomes!=NULL);
+	scan.heads.resize(scan.threads);
+	scan.next=0;
+	scan_run(scan, scan_heads);
+	fasta_record rec;
+	rec.head=-1; rec.begin=0; rec.length=0;
+	for (int t=0; t<scan.threads; t++)
+	{
+		for (long i=0; i<(long)scan.heads[t].size(); i++)
+		{
+			rec.end=scan.heads[t][i];
+			if (rec.end>rec.begin){ scan.records.push_back(rec); }
+			rec.head=rec.begin=rec.end;
+		}
+	}
+	rec.end=scan.size;
+	scan.records.push_back(rec);
+	scan_run(scan, scan_records);
+
+	GenomeClustInfo tg;
+	Genome g;
+	tg.rep=true;
+	for (long r=0; r<(long)scan.records.size(); r++)
+	{
+		fasta_record &rec=scan.records[r];
+		if (rec.length==0){ continue; }
+		tg.descript=rec.meta;
+		tg.id=totalgenomes.size();
+		tg.size=rec.length;
+		tg.offset=max(rec.head, 0L);
+		totalgenomes.push_back(tg);
+		if (allgenomes!=NULL)
+		{
+			g.descript=rec.meta;
+			g.id=tg.id;
+			g.size=rec.length;
+			allgenomes->push_back(g);
+			allgenomes->back().cont.swap(rec.cont);
+		}
+	}
+	munmap(p, st.st_size);
+	return true;
+
+}
+
+// Load total genomes one time.
+void load_total_genomes(string filename, 
+												vector<GenomeClustInfo> &totalgenomes,
+												genome_store *store,
+												int threads,
+												vector<Genome> *allgenomes)
+{
+	long maxlen, totallen, minlen;
+	maxlen=totallen=0;
+	minlen=MAX_GENOME;
+	if (store!=NULL)
+	{
+		GenomeClustInfo tg;
+		tg.rep=true;
+		tg.offset=0;
+		for (long i=0; i<store->genomes; i++)
+		{
+			const long *t=store->table+4*i;
+			tg.id=i;
+			tg.size=t[1];
+			tg.descript.assign(store->base+t[2], t[3]);
+			totalgenomes.push_back(tg);
+		}
+	}else if ((allgenomes!=NULL)||(!read_fasta_index(filename, totalgenomes)))
+	{
+		if (!parse_fasta_parallel(filename, totalgenomes, allgenomes, threads))
+		{
+			scan_total_genomes(filename, totalgenomes, threads);
+			if (allgenomes!=NULL){ load_part_genomes_all(filename, *allgenomes, threads); }
+		}
+		write_fasta_index(filename, totalgenomes);
+	}
+	long loadnum=totalgenomes.size();
+	for (long i=0; i<loadnum; i++)
+	{
+		long length=totalgenomes[i].size;
 		totallen+=length;
 		if (length>maxlen){	maxlen=length; }
 		if (length<minlen){ minlen=length; }
-		loadnum++;
-		id++;
 	}
 
 	cerr<<"=====================\n\n";
@@ -596,3 +821,192 @@ void load_total_genomes(string filename,
 
 }
 
+// Note: the store is this header, the genome contents back to back, then
+// the table and the names at the offsets given here. Table offsets are
+// from the start of the store.
+struct store_header
+{
+	char magic[8];
+	long insize, mtime; // Input the store was converted from.
+	long genomes, table, names, bytes;
+
+};
+
+// Note: version 2 keeps the lines before the first header as an unnamed
+// genome, as the other readers do.
+static const char STORE_MAGIC[8] = {'G','C','S','T','O','R','E','2'};
+
+// Convert filename into the store name, through a private file renamed
+// into place. Contents are normalized as the loaders do, names as in
+// load_total_genomes.
+static void convert_genome_store(string filename, string name, int threads)
+{
+	struct stat st;
+	store_header h;
+	memset(&h, 0, sizeof(h));
+	char pid[32];
+	sprintf(pid, ".%ld", (long)getpid());
+	string part=name+pid;
+	input_stream data(filename, threads);
+	if ((!data.is_open())||(stat(filename.c_str(), &st)!=0)) { 
+		cerr << "unable to open " << filename << endl; 
+		exit(1); 
+	}
+	ofstream out(part.c_str(), ios::binary);
+	if (!out.is_open()) { 
+		cerr << "unable to write " << part << endl; 
+		exit(1); 
+	}
+	out.write((char *)&h, sizeof(h));
+	vector<long> table;
+	string meta, line, names, S;
+	long pos=sizeof(h), head=pos, length=0;
+	while(!data.eof()) {
+		getline(data, line); // Load one line at a time.
+		if(line.length() == 0) continue;
+		if(line[0] == '>') { // Meta tag line and start of a new sequence.
+			if(length > 0) { // Save previous sequence and meta data.
+				table.push_back(head);
+				table.push_back(length);
+				table.push_back(names.size());
+				table.push_back(meta.size());
+				names += meta;
+			}
+			length = 0; // Reset parser state.
+			head=pos;
+		}
+		S.clear();
+		long n = fasta_line(line.data(), line.length(), meta, &S);
+		out.write(S.data(), n);
+		length += n;
+		pos += n;
+	}
+	if(length > 0) { // Last one.
+		table.push_back(head);
+		table.push_back(length);
+		table.push_back(names.size());
+		table.push_back(meta.size());
+		names += meta;
+	}
+	// Table on an 8 byte boundary.
+	long pad = (8-pos%8)%8;
+	out.write("\0\0\0\0\0\0\0", pad);
+	memcpy(h.magic, STORE_MAGIC, sizeof(h.magic));
+	h.insize = (long)st.st_size;
+	h.mtime = (long)st.st_mtime;
+	h.genomes = table.size()/4;
+	h.table = pos+pad;
+	h.names = h.table+(long)(table.size()*sizeof(long));
+	h.bytes = h.names+(long)names.size();
+	for (long i=2; i<(long)table.size(); i+=4){ table[i]+=h.names; }
+	if (!table.empty()){ out.write((char *)&table[0], table.size()*sizeof(long)); }
+	out.write(names.data(), names.size());
+	out.seekp(0);
+	out.write((char *)&h, sizeof(h));
+	out.close();
+	if ((out.fail())||(rename(part.c_str(), name.c_str())!=0)) {
+		unlink(part.c_str());
+		cerr << "unable to write " << name << endl; 
+		exit(1); 
+	}
+
+}
+
+// Map the store name, if it was converted from the current filename.
+static bool map_genome_store(string filename, string name, genome_store &store)
+{
+	struct stat st, sst;
+	if (stat(filename.c_str(), &st)!=0){ return false; }
+	int fd=open(name.c_str(), O_RDONLY);
+	if (fd<0){ return false; }
+	if ((fstat(fd, &sst)!=0)||(sst.st_size<(long)sizeof(store_header)))
+	{
+		close(fd);
+		return false;
+	}
+	void *p=mmap(NULL, sst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p==MAP_FAILED){ return false; }
+	const store_header *h=(const store_header *)p;
+	if ((memcmp(h->magic, STORE_MAGIC, sizeof(h->magic))!=0)||(h->bytes!=(long)sst.st_size)||
+			(h->insize!=(long)st.st_size)||(h->mtime!=(long)st.st_mtime))
+	{
+		munmap(p, sst.st_size);
+		return false;
+	}
+	store.base=(const char *)p;
+	store.genomes=h->genomes;
+	store.table=(const long *)(store.base+h->table);
+	return true;
+
+}
+
+void open_genome_store(string filename, genome_store &store, int threads)
+{
+	string name=filename+".gcs";
+	if (map_genome_store(filename, name, store)){ return; }
+	cerr<<"Converting "<<filename<<" into "<<name<<" ......"<<endl;
+	convert_genome_store(filename, name, threads);
+	if (!map_genome_store(filename, name, store))
+	{
+		cerr << "unable to map " << name << endl; 
+		exit(1); 
+	}
+
+}
+
+void load_part_genomes_store(genome_store &store, vector<Genome> &partgenomes)
+{
+	Genome tg;
+	partgenomes.reserve(store.genomes);
+	for (long i=0; i<store.genomes; i++)
+	{
+		const long *t=store.table+4*i;
+		tg.id=i;
+		tg.size=t[1];
+		tg.view=store.base+t[0];
+		tg.descript.assign(store.base+t[2], t[3]);
+		partgenomes.push_back(tg);
+	}
+
+}
+
+// Order genome indexes by decreasing length.
+struct size_greater
+{
+	vector<GenomeClustInfo> &genomes;
+	size_greater(vector<GenomeClustInfo> &genomes_) : genomes(genomes_) {}
+	bool operator() (long a, long b) const { return genomes[a].size > genomes[b].size; }
+
+};
+
+bool order_genomes(vector<GenomeClustInfo> &totalgenomes, vector<Genome> &allgenomes)
+{
+	long n=totalgenomes.size(), i=1;
+	while ((i<n)&&(totalgenomes[i].size<=totalgenomes[i-1].size)){ i++; }
+	if (i>=n){ return false; }
+	vector<long> order(n);
+	for (i=0; i<n; i++){ order[i]=i; }
+	// Note: stable as the sort of sortgenome.pl, genomes of equal length
+	// keep their input order.
+	stable_sort(order.begin(), order.end(), size_greater(totalgenomes));
+	vector<GenomeClustInfo> sorted(n);
+	for (i=0; i<n; i++)
+	{
+		sorted[i]=std::move(totalgenomes[order[i]]);
+		sorted[i].id=i;
+	}
+	totalgenomes.swap(sorted);
+	if (!allgenomes.empty())
+	{
+		vector<Genome> sortedall(n);
+		for (i=0; i<n; i++)
+		{
+			sortedall[i]=std::move(allgenomes[order[i]]);
+			sortedall[i].id=i;
+		}
+		allgenomes.swap(sortedall);
+	}
+	return true;
+
+}
@@ -3,11 +3,13 @@
 
 #include <string>
 #include <vector>
+#include <pthread.h>
 
 using namespace std;
 
 const long MAX_GENOME = 1000000000;
-const long MAX_THREADCONTAINER = 10000000;
+const long MIN_THREADCONTAINER = 16384; // Initial per-thread match buffer.
+const long MATCH_BUFMEM = 2048; // Default match buffer budget, MB.
 const	long MAX_PARTNUMBER = 500;
 const long MAX_PARTNUMBERFORPERFECT = 40000;
 const long PART_BASE = 1000000; // 1MB
@@ -21,6 +23,14 @@ struct hit
 
 };
 
+// Hit of one query, collected per thread during a pass.
+struct hit_edge
+{
+	long query;
+	hit h;
+
+};
+
 // For single genome search.
 struct Genome
 {
@@ -28,6 +38,22 @@ struct Genome
 	long id; //index
 	string descript; // genome name
 	string cont; // genome content
+	const char *view; // content in the mapped genome store, else NULL
+
+	Genome() : size(0), id(0), view(NULL) {}
+	// Genome content, size characters.
+	const char *seq() const { return (view!=NULL) ? view : cont.data(); }
+
+};
+
+// Binary store of the normalized genomes of an input, mapped read only.
+struct genome_store
+{
+	const char *base;
+	long genomes;
+	const long *table; // Content offset, size, name offset and length per genome.
+
+	genome_store() : base(NULL), genomes(0), table(NULL) {}
 
 };
 
@@ -38,8 +64,9 @@ struct GenomeClustInfo
 	long id; //index
 	bool rep; // if it is representive of clustering
 	double mumindex; //another index
+	long offset; // byte offset of the header line in the input
 	string descript; //genome name
-	vector<hit> clusters, clusterunits;
+	vector<hit> clusterunits;
 
 };
 
@@ -61,6 +88,20 @@ void load_part_genomes(string filename,
 											 long previous,
 											 long number);
 
+// Progress of the clustering passes for a loader running ahead of them:
+// genomes below value have final rep flags.
+struct ready_mark
+{
+	long value;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Value changed.
+
+};
+
+// Set the mark and wake the loader waiting on it.
+void set_ready(ready_mark &mark, long value);
+
+// When ready is set, rep flags are read only for genomes below its value.
 void load_part_genomes_internal(string filename, 
 																vector<Genome> &partgenomes,
 																vector<GenomeClustInfo> &totalgenomes,
@@ -68,9 +109,10 @@ void load_part_genomes_internal(string filename,
 																int &number,
 																long totalsize,
 																bool &ifend,
-																int memiden);
+																int memiden,
+																ready_mark *ready = NULL);
 
-void load_part_genomes_all(string filename, vector<Genome> &partgenomes);
+void load_part_genomes_all(string filename, vector<Genome> &partgenomes, int threads = 1);
 // Load part genomes into memory between parts.
 void load_part_genomes_mem(vector<Genome> &allpartgenomes, 
 													 vector<Genome> &partgenomes,
@@ -97,8 +139,28 @@ void make_block_ref(vector<Genome> &partgenomes,
 										vector<long> &descr,
 										vector<long> &startpos);
 
-// Load total genomes.
-void load_total_genomes(string filename, vector<GenomeClustInfo> &totalgenomes);
+// Load total genomes, from store when given, else from the index 
+// <filename>.gfi when it matches the input, else by one scan of the input
+// on threads that also writes the index. With allgenomes the scan loads
+// all genomes too.
+void load_total_genomes(string filename, 
+												vector<GenomeClustInfo> &totalgenomes,
+												genome_store *store = NULL,
+												int threads = 1,
+												vector<Genome> *allgenomes = NULL);
+
+// Map the store <filename>.gcs, converting filename first when the store
+// is missing or does not match it.
+void open_genome_store(string filename, genome_store &store, int threads = 1);
+
+// Views of all genomes of the store, without copying their contents.
+void load_part_genomes_store(genome_store &store, vector<Genome> &partgenomes);
+
+// Order the genomes by decreasing length, the ids follow the new order
+// and allgenomes, when loaded, is reordered the same way. The loaders 
+// read the genomes from their offsets in this order.
+// Returns false when the input was already sorted.
+bool order_genomes(vector<GenomeClustInfo> &totalgenomes, vector<Genome> &allgenomes);
 
 #endif // __FASTA_HPP__
 
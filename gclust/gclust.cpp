@@ -11,15 +11,22 @@
 #include <fstream>
 #include <vector>
 #include <getopt.h>
+#include <sched.h>
+#include <unistd.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <cctype>
 #include "fasta.hpp"
 #include "paraSA.hpp"
+#ifdef GCLUST_MPI
+#include <mpi.h>
+#endif
 
 using namespace std;
 
 void usage(string prog);
+void run_resolve(long begin, long n);
 
 int K = 1; // Note: Using sparse suffix array for larger chunk size.
 int Nchunk = 2; // load one time for remaining genomes clustering.
@@ -27,9 +34,10 @@ int chunk = 100; // block size for clustering part by part.
 int min_len = 20; // Default minimum exact match length.
 int MEMiden = 90; // Default identity cutoff.
 int total_threads = 1; // Threads number.
+long bufmem = MATCH_BUFMEM; // Match buffer budget of all threads, MB.
 
 // MEM extension parameters
-int ext = 1; // noextension, gap or ungap extension
+int ext = 1; // noextension, gap, ungap or word-level ungap extension
 int mas = 1; // Match score
 int umas = -1; // Mismatch cost
 int gapo = -1; // Gap open penalty
@@ -40,38 +48,134 @@ bool rev_comp = false;
 bool nucleotides_only = false;
 bool rebuild = false; // Rebuild suffix array into one part.
 bool loadall = false; // load all genomes one time, need more memory.
+bool rankref = false; // Evaluate references in decreasing MEM coverage order.
+bool lazyext = false; // Stop extending once the identity cutoff is reached.
+bool pipeline = false; // Load the next block while the current one is searched.
+bool prebuild = false; // Build the next chunk's suffix array in the loader.
+bool online = false; // Compare chunk genomes only with decided representatives.
+int numa = 0; // Suffix array placement: default, interleaved or per node.
+bool hugepages = false; // Back the index arrays with 2 MB pages.
+bool store = false; // Read the genomes from the binary store of the input.
 
 paraSA *sa, *saa; // Suffix array.
 
 vector<Genome> refseqs, allrefseqs; // Part genomes and total part genomes.
+genome_store gstore; // Mapped store of the input with -store.
 vector<GenomeClustInfo> totalgenomes; // Total genomes.
-vector<vector<match_t> > matchlist; // Parallel buffer for match_t.
-vector<vector<mumi_unit> > mumilist; // parallel buffer for mumi_unit.
+genome_cache extseqs; // Extension sequences of all genomes.
+vector<char> refstates; // Online part clustering state of every genome.
+long bufcap; // Match buffer capacity of one thread, in matches.
+int mpi_rank = 0, mpi_size = 1; // This process and number of MPI ranks.
+#ifdef GCLUST_MPI
+MPI_Comm node_comm; // Ranks sharing the memory of this node.
+int node_rank = 0, node_size = 1;
+#endif
+
+// Per-thread state, owned by its worker for the whole run.
+struct worker_state
+{
+	match_buf matches; // Match information container.
+	vector<mumi_unit> mumis; // Mem index container.
+	mem_scratch scratch; // Identity scratch containers.
+
+};
+
+vector<long> passorder; // Genomes of refseqs in decreasing length.
+volatile long passnext; // Next position of passorder to claim.
+bool passshared; // Queries of the pass are split over the MPI ranks.
+
+// Hits of one pass in CSR form: the hits of genome begin+i are 
+// passedges[passoff[i]] to passedges[passoff[i+1]-1], in the order found.
+vector<long> passoff;
+vector<hit_edge> passedges;
+vector<long> passpick; // Hit picked for each genome, or -1.
+vector<char> passstates; // Resolution state of each genome.
+volatile long resnext; // Next genome of the resolution to claim.
+const long RESOLVE_BLOCK = 1024; // Genomes claimed at once.
 
 struct threads_arg // Multithreads parallel parameters passing.
 { 
-	int skip;
-	int skip0; // Zebra-style distribution.
 	long chunk;
 	long begin; // Begin alignment position.
 	bool part; // If internal part clustering.
+	int task; // What the workers do with the pass.
+
+};
+
+const int TASK_QUERIES = 0; // Query refseqs against saa.
+const int TASK_RESOLVE = 1; // Resolve the hits of a pass.
+const int TASK_PLACE = 2; // Place saa on the NUMA nodes.
+
+// Persistent worker pool, created once and fed one pass at a time.
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER; // New pass or quit.
+pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER; // Pass finished.
+threads_arg pool_pass; // Current pass.
+long pool_gen = 0; // Passes submitted so far.
+int pool_left = 0; // Workers still inside the current pass.
+bool pool_quit = false;
+vector<pthread_t> pool_ids;
+vector<worker_state *> pool_states; // For collecting the hits.
+
+// NUMA placement: workers are spread round robin over the nodes.
+vector<vector<int> > numa_cpus; // CPUs of every node.
+long numa_nodes = 1; // Nodes in use, at most one per worker.
+__thread long worker_node = 0; // Node of the calling worker.
+vector<paraSA *> replicas; // Copy of saa per node with -numa 2.
+vector<string> replica_refs; // Their texts.
+
+// Pages of one array copied by the workers with -numa 1.
+struct place_job
+{
+	char *dst;
+	const char *src;
+	long bytes;
 
 };
+vector<place_job> place_jobs;
+
+// Suffix array text of an internal chunk, on the heap so that a suffix 
+// array built by the loader keeps referencing it.
+struct chunk_text
+{
+	string ref;
+	vector<long> refdescr, startpos;
 
-// Note: just test distances between genomes.
+};
+
+// Pipelined loading: one block prepared ahead by the loader thread.
+struct load_slot
+{
+	vector<Genome> genomes;
+	int chunk; // Internal chunk only.
+	bool ifend;
+	chunk_text *text;
+	paraSA *sa; // Built from text with -prebuild, else NULL.
+
+};
+
+struct loader_arg
+{
+	string fasta;
+	long chunksize;
+
+};
+
+pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pipe_cond = PTHREAD_COND_INITIALIZER; // Slot filled or emptied.
+load_slot pipe_slot;
+bool pipe_full = false;
+ready_mark pipe_ready = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER}; // Loader's progress mark.
+pthread_t pipe_id;
+
+// Note: just test distances between genomes, hits of the last pass.
 void testDistanceBgenomes(vector<GenomeClustInfo> &totalgenomes)
 {
-	for (long i=0; i<(long)totalgenomes.size(); i++)
+	for (long k=0; k<(long)passedges.size(); k++)
 	{
-		if (totalgenomes[i].clusters.size()>0)
-		{	
-			for (long j=0; j<(long)totalgenomes[i].clusters.size(); j++)
-			{
-				hit thit;
-				thit = totalgenomes[i].clusters[j];
-				cerr<<thit.id<<"\t"<<thit.identity<<endl;
-			}
-		}
+		hit thit;
+		thit = passedges[k].h;
+		cerr<<thit.id<<"\t"<<thit.identity<<endl;
 	}
 
 }
@@ -109,6 +213,99 @@ void outputClusteringInfoSimple(vector<GenomeClustInfo> &totalgenomes)
 
 }
 
+#ifdef GCLUST_MPI
+// Note: exchange the hits of a pass split over the ranks, so that every
+// rank resolves the same clustering. The result is left in the first 
+// worker's buffer, rank by rank; each query still comes from one thread.
+void gather_hits()
+{
+	vector<hit_edge> local, all;
+	vector<int> counts(mpi_size), displs(mpi_size);
+	int bytes;
+
+	for (long t=0; t<(long)pool_states.size(); t++)
+	{
+		vector<hit_edge> &hits=pool_states[t]->scratch.hits;
+		local.insert(local.end(), hits.begin(), hits.end());
+		hits.clear();
+	}
+	bytes = (int)(local.size()*sizeof(hit_edge));
+	MPI_Allgather(&bytes, 1, MPI_INT, &counts[0], 1, MPI_INT, MPI_COMM_WORLD);
+	long total = 0;
+	for (int r=0; r<mpi_size; r++){ displs[r]=(int)total; total+=counts[r]; }
+	all.resize(total/sizeof(hit_edge)+1);
+	MPI_Allgatherv(local.empty() ? NULL : &local[0], bytes, MPI_BYTE, 
+								 &all[0], &counts[0], &displs[0], MPI_BYTE, MPI_COMM_WORLD);
+	all.resize(total/sizeof(hit_edge));
+	pool_states[0]->scratch.hits.swap(all);
+}
+#endif
+
+// Merge the per-thread hits of the pass over genomes [begin, begin+n)
+// into passoff/passedges. All hits of a query come from one thread, in 
+// order, so a stable scatter keeps them in the order they were found.
+void collect_hits(long begin, long n)
+{
+#ifdef GCLUST_MPI
+	if ((passshared)&&(mpi_size>1)){ gather_hits(); }
+#endif
+	passoff.assign(n+1, 0);
+	for (long t=0; t<(long)pool_states.size(); t++)
+	{
+		vector<hit_edge> &hits=pool_states[t]->scratch.hits;
+		for (long k=0; k<(long)hits.size(); k++){ passoff[hits[k].query-begin+1]++; }
+	}
+	for (long i=0; i<n; i++){ passoff[i+1]+=passoff[i]; }
+	passedges.resize(passoff[n]);
+	passpick.assign(passoff.begin(), passoff.end()-1); // Fill positions.
+	for (long t=0; t<(long)pool_states.size(); t++)
+	{
+		vector<hit_edge> &hits=pool_states[t]->scratch.hits;
+		for (long k=0; k<(long)hits.size(); k++)
+		{
+			passedges[passpick[hits[k].query-begin]++]=hits[k];
+		}
+		hits.clear();
+	}
+}
+
+// Note: decide the genomes of a pass on the pool. Each genome takes its 
+// first hit to a representative. Genomes are claimed in order, so an 
+// undecided hit always belongs to a genome claimed earlier and is waited
+// for; the decisions equal the serial sweep.
+void resolve_hits(threads_arg *arg)
+{
+	long begin = arg->begin;
+	long n = arg->chunk;
+	long lo, hi, pick, j;
+	bool rep;
+
+	while (1)
+	{
+		lo = __sync_fetch_and_add(&resnext, RESOLVE_BLOCK);
+		if (lo >= n){ break; }
+		hi = min(lo+RESOLVE_BLOCK, n);
+		for (long i=lo; i<hi; i++)
+		{
+			if (passstates[i]!=REF_PENDING){ continue; }
+			pick=-1;
+			for (long k=passoff[i]; k<passoff[i+1]; k++)
+			{
+				j=passedges[k].h.id;
+				if ((j>=begin)&&(j<begin+n))
+				{
+					rep=(wait_state(&passstates[j-begin])==REF_REP);
+				}else{
+					rep=totalgenomes[j].rep; // Fixed during the resolution.
+				}
+				if (rep){ pick=k; break; }
+			}
+			passpick[i]=pick;
+			publish_state(&passstates[i], (pick<0) ? REF_REP : REF_CLUSTERED);
+		}
+	}
+}
+
 // Note: collect clustering information.
 void getClusteringInfoOnepart(vector<GenomeClustInfo> &totalgenomes,
 															long begin,
@@ -116,156 +313,547 @@ void getClusteringInfoOnepart(vector<GenomeClustInfo> &totalgenomes,
 															bool inpart,
 															bool &clusterhit)
 {	
-	long b,e;
 	clusterhit=false;
-	b=begin;
-	e=begin+chunk;
-	for (long i=b; i<e; i++)
-	{	
-		if (!totalgenomes[i].rep){ continue; }	
-		if (totalgenomes[i].clusters.size()>0)
-		{	
-			for (long j=0; j<(long)totalgenomes[i].clusters.size(); j++)
-			{
-				hit thit;
-				thit=totalgenomes[i].clusters[j];
-				if (totalgenomes[thit.id].rep)
-				{
-					hit thit0;
-					thit0.id=i;
-					thit0.identity=thit.identity;
-					thit0.strand=thit.strand;
-					totalgenomes[thit.id].clusterunits.push_back(thit0);
-					totalgenomes[i].rep=false;
-					clusterhit=true;
-					break;
-				}
-			}
-			// Note: important clear
-			totalgenomes[i].clusters.clear();
+	collect_hits(begin, chunk);
+	passstates.resize(chunk);
+	passpick.assign(chunk, -1);
+	for (long i=0; i<chunk; i++)
+	{
+		passstates[i] = (totalgenomes[begin+i].rep) ? REF_PENDING : REF_CLUSTERED;
+	}
+	run_resolve(begin, chunk);
+	// Clustering units are appended in genome order.
+	for (long i=0; i<chunk; i++)
+	{
+		if (passpick[i]<0){ continue; }
+		hit thit, thit0;
+		thit=passedges[passpick[i]].h;
+		thit0.id=begin+i;
+		thit0.identity=thit.identity;
+		thit0.strand=thit.strand;
+		totalgenomes[thit.id].clusterunits.push_back(thit0);
+		totalgenomes[begin+i].rep=false;
+		clusterhit=true;
+	}
+}
+
+// Identity of the query against the references of the matches held in
+// the buffer.
+bool batch_identity(paraSA *index,
+										Genome &tg,
+										match_buf &matches,
+										vector<mumi_unit> &mumis,
+										mem_scratch &scratch,
+										long beginclust,
+										long chunk,
+										bool ispart,
+										char strand)
+{
+	bool ifhit=false;
+	// Loading match information.
+	index->load_match_info(tg.id, matches, mumis, true, tg.size);
+	matches.vec.clear();
+	ifhit=ComputeMemIdentity(totalgenomes, 
+													 extseqs, 
+													 mumis, 
+													 scratch,
+													 beginclust, 
+													 tg.id, 
+													 MEMiden, 
+													 ispart, 
+													 chunk, 
+													 strand, 
+													 rankref,
+													 lazyext,
+													 ((ispart)&&(online)) ? &refstates[0] : NULL,
+													 ext, 
+													 mas,
+													 umas, 
+													 gapo, 
+													 gape,
+													 drops);
+	mumis.clear();
+	return ifhit;
+
+}
+
+// Note: find MEMs of one query strand against the references of the
+// chunk and compute identity. Matches past the thread's buffer
+// are spilled in sorted runs, the one search is then evaluated a batch
+// of whole references at a time in reference order.
+bool strand_identity(string &P,
+										 Genome &tg,
+										 match_buf &matches,
+										 vector<mumi_unit> &mumis,
+										 mem_scratch &scratch,
+										 long beginclust,
+										 long chunk,
+										 bool ispart,
+										 char strand)
+{
+	double cutoff=(double)MEMiden/100;
+	bool ifhit=false;
+	paraSA *index = (numa==2) ? replicas[worker_node] : saa; // Local copy.
+
+	matches.clear();
+	// 100% ?
+	if (MEMiden==100)
+	{
+		index->MEMperfect(P, matches, tg.size, tg.id);
+	}else{
+		index->MEM(P, matches, min_len, tg.id);
+	}
+	// Total match length of the search, stored or spilled.
+	if ((double)matches.lensum/tg.size < cutoff)
+	{
+		matches.clear();
+		return false;
+	}
+	if (!matches.overflow)
+	{
+		ifhit=batch_identity(index, tg, matches, mumis, scratch, beginclust, chunk, ispart, strand);
+		matches.clear();
+		return ifhit;
+	}
+	// A hit ends the query as it does within one batch.
+	matches.spill_run();
+	while (matches.next_batch(rankref))
+	{
+		if (batch_identity(index, tg, matches, mumis, scratch, beginclust, chunk, ispart, strand))
+		{
+			ifhit=true;
+			if ((!ispart)||(online)){ break; }
 		}
 	}
+	matches.clear();
+	// Units of a reference larger than the buffer are not kept.
+	if ((long)mumis.capacity() > matches.cap){ vector<mumi_unit>().swap(mumis); }
+	return ifhit;
+
 }
 
-// Note: one genome as reference (internal part).
-void *single_thread(void *arg_)
+// Order genomes of refseqs by decreasing length for the next pass.
+bool longer_first(long a, long b)
 {
-	Genome tg;
-	threads_arg *arg = (threads_arg *)arg_;
+	return refseqs[a].size > refseqs[b].size;
+}
 
-	// Match information container.
-	vector<match_t> &matches=matchlist[arg->skip0];
-	// Mem index container.
-	vector<mumi_unit> &mumis=mumilist[arg->skip0];
+// Note: threads claim the genomes longest first from a shared counter,
+// so the large queries do not all end up at the tail of one thread.
+// Online part clustering keeps the chunk order, a query only waits for
+// genomes claimed before it. Split over MPI ranks, every rank takes each
+// mpi_size-th genome of the order.
+void schedule_pass(bool inorder, bool shared)
+{
+	long k=0;
+	passorder.resize(refseqs.size());
+	for (long i=0;i<(long)refseqs.size();i++){ passorder[i]=i; }
+	if (!inorder){ stable_sort(passorder.begin(), passorder.end(), longer_first); }
+	if (shared)
+	{
+		for (long i=mpi_rank;i<(long)passorder.size();i+=mpi_size){ passorder[k++]=passorder[i]; }
+		passorder.resize(k);
+	}
+	passshared=shared;
+	passnext=0;
+}
+
+// Note: one genome as reference (internal part).
+void pass_queries(worker_state &ws, threads_arg *arg)
+{
+	match_buf &matches=ws.matches;
+	vector<mumi_unit> &mumis=ws.mumis;
+	mem_scratch &scratch=ws.scratch;
 
 	long seq_cnt = 0;
+	long claimed;
 	long beginclust = arg->begin;
 	long chunk = arg->chunk;
-	long sizeadd = 0;
-	long edge = long(refseqs.size()-1);
+	long edge = long(passorder.size())-1;
 	bool ifhit = false;
 	bool ispart = arg->part;
-	double cutoff=(double)MEMiden/100;
 	string *P=new string; 
-	edge=long(refseqs.size()-1); 
 
 	while(1) 
 	{
-		if ( seq_cnt > edge ){ break; }
-		if ( arg->skip0 == 0 ){
-			if (seq_cnt % 100 ==0){
-				cerr<<"...... "<<seq_cnt<<" done"<<endl;
-			}
+		claimed = __sync_fetch_and_add(&passnext, 1);
+		if ( claimed > edge ){ break; }
+		if (claimed % 100 ==0){
+			cerr<<"...... "<<claimed<<" done"<<endl;
 		}
+		seq_cnt = passorder[claimed];
 		// paralle part.
-		if( seq_cnt % arg->skip == arg->skip0 ) 
+		ifhit=false;
+		Genome &tg=refseqs[seq_cnt];
+		if ( totalgenomes[tg.id].rep )
 		{
-			ifhit=false;
-			tg=refseqs[seq_cnt];
-			if ( totalgenomes[tg.id].rep )
+			P->assign(tg.seq(), tg.size);
+			// Filter 'n'.
+			if (nucleotides_only)
+			{ 
+				filter_n(*P);
+			}
+			ifhit=strand_identity(*P, tg, matches, mumis, scratch, beginclust, chunk, 
+														ispart, '+');
+			if (((ispart)&&(!online))||(!ifhit))
 			{
-				*P=tg.cont;
-				// Filter 'n'.
-				if (nucleotides_only)
-				{ 
-					filter_n(*P);
-				}
-				// 100% ?
-				if (MEMiden==100)
-				{
-					saa->MEMperfect(*P, matches, tg.size, tg.id);
-				}else{
-					saa->MEM(*P, matches, min_len, tg.id);
-				}
-				sizeadd += saa->load_match_info(tg.id, matches, mumis, true, tg.size);
-				matches.clear();
-				if ((double)sizeadd/tg.size >= cutoff)
-				{
-					ifhit=ComputeMemIdentity(totalgenomes, 
-																	 allrefseqs, 
-																	 mumis, 
-																	 beginclust, 
-																	 tg.id, 
-																	 MEMiden, 
-																	 ispart, 
-																	 chunk, 
-																	 '+', 
-																	 ext, 
-																	 mas,
-																	 umas, 
-						                       gapo, 
-						                       gape,
-						                       drops);
-				}
-				mumis.clear();
-        sizeadd=0;
-
-				if ((ispart)||(!ifhit))
-				{
-					if(rev_comp) {
-						reverse_complement(*P, nucleotides_only);
-						// 100% ?
-						if (MEMiden==100)
-						{
-							saa->MEMperfect(*P, matches, tg.size, tg.id);
-						}else{
-							saa->MEM(*P, matches, min_len, tg.id);
-						}
-						// Loading match information - strand.
-					  sizeadd += saa->load_match_info(tg.id, matches, mumis, true, tg.size);
-						matches.clear();
-
-						if ((double)sizeadd/tg.size >= cutoff)
-						{
-							ComputeMemIdentity(totalgenomes, 
-								                 allrefseqs, 
-								                 mumis,
-																 beginclust, 
-								                 tg.id, 
-								                 MEMiden,
-																 ispart, 
-								                 chunk, 
-								                 '-', 
-								                 ext, 
-								                 mas,
-																 umas, 
-								                 gapo, 
-								                 gape, 
-								                 drops);
-						}
-						sizeadd=0;
-						mumis.clear();
-					}
+				if(rev_comp) {
+					reverse_complement(*P, nucleotides_only);
+					if (strand_identity(*P, tg, matches, mumis, scratch, beginclust, chunk, 
+															ispart, '-')){ ifhit=true; }
 				}
 			}
+			// Publish the decision to the later queries of the chunk.
+			if ((ispart)&&(online))
+			{
+				publish_state(&refstates[tg.id], (ifhit) ? REF_CLUSTERED : REF_REP);
+			}
 		}
-		seq_cnt++;
-		delete P; 
-		P = new string;
 
 	}
 	delete P;
-	pthread_exit(NULL);
+	// Help the threads still busy with large queries.
+	iden_pool_help(scratch);
+
+}
+
+// Note: NUMA nodes and their CPUs from sysfs, the workers are pinned 
+// round robin to them.
+void numa_setup()
+{
+	char path[128];
+	string list;
+	for (int node=0; ; node++)
+	{
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+		ifstream data(path);
+		if (!data.is_open()){ break; }
+		getline(data, list);
+		// Ranges like 0-3,8-11.
+		vector<int> cpus;
+		long pos=0;
+		while (pos<(long)list.length())
+		{
+			long comma=list.find(',', pos);
+			if (comma==(long)string::npos){ comma=list.length(); }
+			string range=list.substr(pos, comma-pos);
+			long dash=range.find('-');
+			int lo=atoi(range.c_str());
+			int hi=(dash==(long)string::npos) ? lo : atoi(range.c_str()+dash+1);
+			for (int c=lo; c<=hi; c++){ cpus.push_back(c); }
+			pos=comma+1;
+		}
+		numa_cpus.push_back(cpus);
+	}
+	if (numa_cpus.empty()){ numa_cpus.resize(1); }
+	numa_nodes = min((long)numa_cpus.size(), (long)total_threads);
+	replicas.assign(numa_nodes, (paraSA *)NULL);
+	replica_refs.resize(numa_nodes);
+	cerr<<"NUMA nodes: "<<numa_cpus.size()<<", used: "<<numa_nodes<<endl;
+}
+
+void numa_pin(long node)
+{
+	cpu_set_t set;
+	if (numa_cpus[node].empty()){ return; }
+	CPU_ZERO(&set);
+	for (long i=0; i<(long)numa_cpus[node].size(); i++){ CPU_SET(numa_cpus[node][i], &set); }
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Note: place saa by first touch from the worker's node. With -numa 2 the
+// first worker of every node copies the whole index and text; with 
+// -numa 1 the pages of the index arrays go round robin over the nodes,
+// shared by the workers of a node.
+void place_index(long worker)
+{
+	if (numa==2)
+	{
+		if (worker>=numa_nodes){ return; }
+		replica_refs[worker_node] = saa->S;
+		replicas[worker_node] = new paraSA(*saa, replica_refs[worker_node]);
+		return;
+	}
+	long page = sysconf(_SC_PAGESIZE);
+	long peers = (total_threads-worker_node+numa_nodes-1)/numa_nodes;
+	long mine = worker/numa_nodes;
+	for (long j=0; j<(long)place_jobs.size(); j++)
+	{
+		place_job &job = place_jobs[j];
+		long pages = (job.bytes+page-1)/page;
+		for (long p=worker_node; p<pages; p+=numa_nodes)
+		{
+			if ((p/numa_nodes)%peers != mine){ continue; }
+			memcpy(job.dst+p*page, job.src+p*page, min(page, job.bytes-p*page));
+		}
+	}
+}
+
+// Worker of the pool: run every submitted pass until told to quit.
+void *pool_worker(void *arg_)
+{
+	long seen = 0;
+	threads_arg pass;
+
+	// Allocate the thread's buffers, they grow on demand up to their
+	// share of the budget.
+	worker_state *ws = new worker_state;
+	ws->matches.cap=bufcap;
+	ws->matches.vec.reserve(min(bufcap, MIN_THREADCONTAINER));
+	ws->mumis.reserve(min(bufcap, MIN_THREADCONTAINER));
+	pool_states[(long)arg_] = ws;
+	if (numa!=0)
+	{
+		worker_node = (long)arg_ % numa_nodes;
+		numa_pin(worker_node);
+	}
+
+	while (1)
+	{
+		pthread_mutex_lock(&pool_lock);
+		while ((pool_gen == seen)&&(!pool_quit)){ pthread_cond_wait(&pool_cond, &pool_lock); }
+		if (pool_gen == seen)
+		{
+			pthread_mutex_unlock(&pool_lock);
+			break;
+		}
+		seen = pool_gen;
+		pass = pool_pass;
+		pthread_mutex_unlock(&pool_lock);
+
+		if (pass.task==TASK_RESOLVE){ resolve_hits(&pass); }
+		else if (pass.task==TASK_PLACE){ place_index((long)arg_); }
+		else{ pass_queries(*ws, &pass); }
+
+		pthread_mutex_lock(&pool_lock);
+		if (--pool_left == 0){ pthread_cond_signal(&pool_done); }
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	delete ws;
+	return NULL;
+
+}
+
+void pool_start()
+{
+	pthread_attr_t attr;  pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	pool_ids.resize(total_threads);
+	pool_states.resize(total_threads);
+	for(int i=0; i<total_threads; i++) 
+		pthread_create(&pool_ids[i], &attr, pool_worker, (void *)(long)i);
+	pthread_attr_destroy(&attr);
+}
+
+// Hand one pass to every worker and wait for them.
+void pool_run(long begin, long chunk, bool part, int task)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_pass.begin = begin;
+	pool_pass.chunk = chunk;
+	pool_pass.part = part;
+	pool_pass.task = task;
+	pool_left = total_threads;
+	pool_gen++;
+	pthread_cond_broadcast(&pool_cond);
+	while (pool_left > 0){ pthread_cond_wait(&pool_done, &pool_lock); }
+	pthread_mutex_unlock(&pool_lock);
+}
+
+// Run one pass of refseqs queries on the pool and wait for it.
+void run_pass(long begin, long chunk, bool part)
+{
+	if ((part)&&(online))
+	{
+		for (long i=0;i<(long)refseqs.size();i++)
+		{
+			long id = refseqs[i].id;
+			refstates[id] = (totalgenomes[id].rep) ? REF_PENDING : REF_CLUSTERED;
+		}
+	}
+	// Online decisions are shared through memory, not split over ranks.
+	schedule_pass((part)&&(online), !((part)&&(online)));
+	iden_pool_begin(total_threads);
+	pool_run(begin, chunk, part, TASK_QUERIES);
+}
+
+// Resolve the hits of the pass over genomes [begin, begin+n) on the pool.
+void run_resolve(long begin, long n)
+{
+	resnext = 0;
+	pool_run(begin, n, false, TASK_RESOLVE);
+}
+
+// Add one index array to the interleaved copy.
+void place_array(void *src, long bytes)
+{
+	place_job job;
+	job.src = (const char *)src;
+	job.bytes = bytes;
+	job.dst = (char *)malloc(max(bytes, 1L));
+	place_jobs.push_back(job);
+}
+
+// Report how much of the index arrays of saa got huge pages.
+void report_hugepages()
+{
+	if (!hugepages){ return; }
+	long bytes = saa->SA.size()*sizeof(unsigned int) + saa->ISA.size()*sizeof(int) + 
+		saa->LCP.vec.size();
+	long huge = hugepage_bytes(saa->SA.ptr, saa->SA.size()*sizeof(unsigned int)) + 
+		hugepage_bytes(saa->ISA.ptr, saa->ISA.size()*sizeof(int)) + 
+		hugepage_bytes(saa->LCP.vec.ptr, saa->LCP.vec.size());
+	cerr << "Huge pages: " << huge/1048576 << " of " << bytes/1048576 << " MB" << endl;
+}
+
+// Place a new saa on the NUMA nodes of the workers.
+void place_sa()
+{
+	if (numa==0){ report_hugepages(); return; }
+	place_jobs.clear();
+	if (numa==1)
+	{
+		place_array(saa->SA.ptr, saa->SA.size()*sizeof(unsigned int));
+		place_array(saa->ISA.ptr, saa->ISA.size()*sizeof(int));
+		place_array(saa->LCP.vec.ptr, saa->LCP.vec.size());
+	}
+	pool_run(0, 0, false, TASK_PLACE);
+	if (numa==1)
+	{
+		saa->SA.adopt((unsigned int *)place_jobs[0].dst);
+		saa->ISA.adopt((int *)place_jobs[1].dst);
+		saa->LCP.vec.adopt((unsigned char *)place_jobs[2].dst);
+	}
+	report_hugepages();
+}
+
+// Free saa and its node copies.
+void free_sa()
+{
+	for (long i=0; i<(long)replicas.size(); i++)
+	{
+		delete replicas[i];
+		replicas[i] = NULL;
+	}
+	delete saa;
+}
+
+void pool_stop()
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_quit = true;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+	for(int i=0; i<total_threads; i++) pthread_join(pool_ids[i], NULL);
+}
+
+// Build the suffix array of a chunk. The ranks of a node share one copy
+// of the index, built by the node's first rank.
+paraSA *build_sa(string &ref, vector<long> &refdescr, vector<long> &startpos)
+{
+#ifdef GCLUST_MPI
+	if (node_size > 1)
+	{
+		paraSA *s = new paraSA(ref, refdescr, startpos, true, K, node_rank==0);
+		s->share(node_comm);
+		return s;
+	}
+#endif
+	return new paraSA(ref, refdescr, startpos, true, K);
+}
+
+// Hand a prepared block over, waiting until the previous one is taken.
+void pipe_put(load_slot &slot)
+{
+	pthread_mutex_lock(&pipe_lock);
+	while (pipe_full){ pthread_cond_wait(&pipe_cond, &pipe_lock); }
+	swap(pipe_slot, slot);
+	pipe_full = true;
+	pthread_cond_broadcast(&pipe_cond);
+	pthread_mutex_unlock(&pipe_lock);
+}
+
+// Wait until the main loop has taken the last block.
+void pipe_drain()
+{
+	pthread_mutex_lock(&pipe_lock);
+	while (pipe_full){ pthread_cond_wait(&pipe_cond, &pipe_lock); }
+	pthread_mutex_unlock(&pipe_lock);
+}
+
+void pipe_take(load_slot &slot)
+{
+	pthread_mutex_lock(&pipe_lock);
+	while (!pipe_full){ pthread_cond_wait(&pipe_cond, &pipe_lock); }
+	swap(pipe_slot, slot);
+	pipe_full = false;
+	pthread_cond_broadcast(&pipe_cond);
+	pthread_mutex_unlock(&pipe_lock);
+}
+
+// Note: loader thread, walks the blocks in the order of the main loop.
+// Remaining genomes are copied whatever their rep flags, so they are read
+// freely; the next chunk is selected by rep flags and waits on pipe_ready
+// genome by genome, its make_block_ref text is built here as well.
+// With -prebuild its suffix array follows, so it is ready as soon as the
+// genomes it covers are resolved, usually after the first remaining block.
+void *pipe_loader(void *arg)
+{
+	loader_arg *la = (loader_arg *)arg;
+	load_slot slot;
+	long cbegin = 0, begin, dchunk, loaded;
+	int nchunk;
+	bool ifend;
+
+	while (1)
+	{
+		// The previous chunk must have started its remaining blocks.
+		pipe_drain();
+		slot.genomes.clear();
+		slot.text = new chunk_text;
+		load_part_genomes_internal(la->fasta, 
+				                       slot.genomes, 
+															 totalgenomes, 
+				                       cbegin, 
+															 slot.chunk, 
+				                       la->chunksize, 
+				                       slot.ifend,
+			                         MEMiden,
+															 &pipe_ready);
+		make_block_ref(slot.genomes, 
+				           slot.text->ref, 
+				           totalgenomes, 
+				           slot.text->refdescr, 
+				           slot.text->startpos);
+		slot.sa = NULL;
+		if (prebuild)
+		{
+			slot.sa = new paraSA(slot.text->ref, 
+					                 slot.text->refdescr, 
+					                 slot.text->startpos, 
+					                 true, 
+					                 K);
+		}
+		nchunk = slot.chunk;
+		ifend = slot.ifend;
+		pipe_put(slot);
+		if (ifend) { break; }
+
+		begin = cbegin+nchunk;
+		dchunk = (long)(nchunk*Nchunk);
+		while (1)
+		{
+			slot.genomes.clear();
+			load_part_genomes(la->fasta, slot.genomes, totalgenomes, begin, dchunk);
+			loaded = (long)slot.genomes.size();
+			pipe_put(slot);
+			if (loaded<dchunk) { break; }
+			begin+=dchunk;
+		}
+		cbegin=cbegin+nchunk;
+	}
+	return NULL;
 
 }
 
@@ -273,6 +861,16 @@ int main(int argc, char* argv[])
 {
 	time_t start, end;
         start=time(NULL);
+#ifdef GCLUST_MPI
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, 
+											MPI_INFO_NULL, &node_comm);
+	MPI_Comm_rank(node_comm, &node_rank);
+	MPI_Comm_size(node_comm, &node_size);
+#endif
 	// Version notice.
 	cerr<<"\nGclust version 1.0\n"<<endl;
 	// Collect parameters from the command line.
@@ -301,6 +899,29 @@ int main(int argc, char* argv[])
 			// Sparse step of suffix array
 			{"sparse", 1, 0, 0,}, //15
 
+			// Match buffer budget
+			{"bufmem", 1, 0, 0}, //16
+
+			// Candidate reference ranking
+			{"rank", 0, 0, 0}, //17
+
+			// Lazy extension
+			{"lazyext", 0, 0, 0}, //18
+
+			// Pipelined loading
+			{"pipeline", 0, 0, 0}, //19
+			{"prebuild", 0, 0, 0}, //20
+
+			// Online part clustering
+			{"online", 0, 0, 0}, //21
+
+			// NUMA placement
+			{"numa", 1, 0, 0}, //22
+			{"hugepages", 0, 0, 0}, //23
+
+			// Binary genome store
+			{"store", 0, 0, 0}, //24
+
 			{0, 0, 0, 0}
 
 		};
@@ -336,6 +957,27 @@ int main(int argc, char* argv[])
 				// Sparse step of suffix array
 				case 15: K = atoi(optarg) ; break;
 
+				// Match buffer budget
+				case 16: bufmem = atol(optarg) ; break;
+
+				// Candidate reference ranking
+				case 17: rankref = true ; break;
+				case 18: lazyext = true ; break;
+
+				// Pipelined loading
+				case 19: pipeline = true ; break;
+				case 20: prebuild = pipeline = true ; break;
+
+				// Online part clustering
+				case 21: online = true ; break;
+
+				// NUMA placement
+				case 22: numa = atoi(optarg) ; break;
+				case 23: hugepages = true ; break;
+
+				// Binary genome store
+				case 24: store = true ; break;
+
 				default: break; 
 			}
 		}
@@ -350,23 +992,58 @@ int main(int argc, char* argv[])
 	}
 	// no extension when 100% match
 	if (MEMiden == 100){ ext = 0; }
-	// Allocate memory for multithreads.
-	for (int i=0;i<total_threads; i++)
+	if ((numa < 0)||(numa > 2))
+	{
+		cerr << "invalid NUMA placement specified" << endl;
+		exit(1);
+	}
+	if (bufmem <= 0)
 	{
-		vector<match_t> matches;
-		vector<mumi_unit> mumis;
-		matchlist.push_back(matches);
-		mumilist.push_back(mumis);
-		matchlist[i].reserve(MAX_THREADCONTAINER);
-		mumilist[i].reserve(MAX_THREADCONTAINER);
+		cerr << "invalid match buffer size specified" << endl;
+		exit(1);
 	}
+	// Memory budget of the multithreads buffers: per stored match its unit,
+	// the unit bucketed by reference, the filter copies and extension gap
+	// of PairMemIdentity.
+	bufcap=(bufmem<<20)/total_threads/(sizeof(match_t)+7*sizeof(mumi_unit)+sizeof(pair<long, long>));
+	if (bufcap<1){ bufcap=1; }
+#ifdef GCLUST_MPI
+	// The ranks of a node already share one index.
+	if (node_size > 1){ numa = 0; }
+#endif
+	if (numa!=0){ numa_setup(); }
+	pool_start();
 
 	// Genome file.
 	string ref_fasta = argv[optind]; 
-	// Load total genomes part information.
-	load_total_genomes(ref_fasta, totalgenomes);
-	// Load total part genomes one time.
-	if (loadall) load_part_genomes_all(ref_fasta, allrefseqs); 
+	if (store)
+	{
+#ifdef GCLUST_MPI
+		// Rank 0 converts the input, the other ranks map its store.
+		if (mpi_rank!=0){ MPI_Barrier(MPI_COMM_WORLD); }
+#endif
+		open_genome_store(ref_fasta, gstore, total_threads);
+#ifdef GCLUST_MPI
+		if (mpi_rank==0){ MPI_Barrier(MPI_COMM_WORLD); }
+#endif
+	}
+	// Load total genomes part information, with -loadall the total part
+	// genomes are loaded by the same scan.
+	load_total_genomes(ref_fasta, 
+			               totalgenomes, 
+			               (store) ? &gstore : NULL, 
+			               total_threads, 
+			               ((loadall)&&(!store)) ? &allrefseqs : NULL);
+	if (online){ refstates.assign(totalgenomes.size(), REF_CLUSTERED); }
+	// Views of the total part genomes in the store.
+	if (store){ load_part_genomes_store(gstore, allrefseqs); }
+	// Unsorted inputs are visited longest first through the offsets.
+	if (order_genomes(totalgenomes, allrefseqs)){ cerr<<"Genomes ordered by decreasing length\n"<<endl; }
+	// Genomes held in memory are cut into blocks from allrefseqs.
+	bool inmem = (loadall)||(store);
+	// Extension sequences are converted once per run, from any genomes
+	// held in memory.
+	if ((inmem)&&(ext!=0)) build_genome_cache(allrefseqs, extseqs, ext==3);
 
 	vector<long> refdescr;
 	vector<long> startpos;
@@ -379,15 +1056,47 @@ int main(int argc, char* argv[])
 	bool clusterhit=false;
 	Genome tg; 
 	string ref;
+	chunk_text *ctext = NULL; // Text of a prebuilt suffix array.
+	load_slot slot;
+	loader_arg larg;
 
 	// set chunk size for clustering chunk by chunk.
 	chunksize=(long)chunk*PART_BASE;
+	// Genomes in memory are not worth a loader thread.
+	if (inmem){ pipeline = prebuild = false; }
+#ifdef GCLUST_MPI
+	// A shared index is built by the main threads of the node together.
+	if (node_size > 1){ prebuild = false; }
+#endif
+	if (pipeline)
+	{
+		larg.fasta = ref_fasta;
+		larg.chunksize = chunksize;
+		set_ready(pipe_ready, (long)totalgenomes.size());
+		pthread_create(&pipe_id, NULL, pipe_loader, &larg);
+	}
 
 	// Note: Take a fixed value of total genomes number.
 	// Main clustering loop.
 	while (1) 
 	{
-		if (loadall){ 
+		if (pipeline){
+			pipe_take(slot);
+			refseqs.swap(slot.genomes);
+			chunk = slot.chunk;
+			ifend = slot.ifend;
+			if (prebuild){
+				ctext = slot.text;
+				saa = slot.sa;
+			}else{
+				ref.swap(slot.text->ref);
+				refdescr.swap(slot.text->refdescr);
+				startpos.swap(slot.text->startpos);
+				delete slot.text;
+			}
+			// Remaining genomes are resolved block by block from here.
+			set_ready(pipe_ready, cbegin+chunk);
+		}else if (inmem){ 
 			load_part_genomes_internal_mem(allrefseqs, 
 				                             refseqs, 
 																		 totalgenomes, 
@@ -408,51 +1117,38 @@ int main(int argc, char* argv[])
 		}
 		cerr<<"\nLoad genomes: "<<refseqs.size()<<endl;
 		cerr<<"\nchunk: "<<chunk<<endl;
-		refdescr.clear(); startpos.clear();
-		// Clear container.
-		ref=""; 
-		// Make part suffix array.
-		make_block_ref(refseqs, ref, totalgenomes, refdescr, startpos);
-		cerr<<"Creating suffix array ......\n"<<endl;
-		saa = new paraSA(ref, refdescr, startpos, true, K);
-		cerr<<"\nFinished creating suffix array ......\n"<<endl;
+		if (!pipeline){
+			refdescr.clear(); startpos.clear();
+			// Clear container.
+			ref=""; 
+			// Make part suffix array.
+			make_block_ref(refseqs, ref, totalgenomes, refdescr, startpos);
+		}
+		if (!prebuild){
+			cerr<<"Creating suffix array ......\n"<<endl;
+			saa = build_sa(ref, refdescr, startpos);
+			cerr<<"\nFinished creating suffix array ......\n"<<endl;
+		}
+		place_sa();
 		//genomes=refseqs.size();
 
 		// Part internal clustering || parallel part.
-		pthread_attr_t attr;  pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-		vector<threads_arg> args(total_threads);
-		vector<pthread_t> thread_ids(total_threads);
-
-		// Initialize additional thread data.
-		for(int i=0; i<total_threads; i++)
-		{
-			args[i].skip = total_threads;
-			args[i].skip0 = i;
-			args[i].begin = cbegin;
-			args[i].part = true;
-			args[i].chunk = chunk; 
-		}
-
-		// Create joinable threads to find MEMs.
-		for(int i=0; i<total_threads; i++) 
-			pthread_create(&thread_ids[i], &attr, single_thread, (void *)&args[i]);
-		// Wait for all threads to terminate.
-		for(int i=0; i<total_threads; i++) pthread_join(thread_ids[i], NULL);
+		run_pass(cbegin, chunk, true);
 		// Collect clustering information into one chunk.
 		getClusteringInfoOnepart(totalgenomes, cbegin, chunk, true, clusterhit);
 		if (ifend) { break;} // Finished.
 
 		if ( (rebuild)&&(clusterhit) )
 		{
-			delete saa; ref="";
+			free_sa(); ref="";
 			refdescr.clear(); 
 			startpos.clear();	
 			// Make part suffix array.
 			make_block_ref(refseqs, ref, totalgenomes, refdescr, startpos);
 			cerr<<"Creating suffix array ......\n"<<endl;
-			saa = new paraSA(ref, refdescr, startpos, true, K);
+			saa = build_sa(ref, refdescr, startpos);
 			cerr<<"\nFinished creating suffix array ......\n"<<endl;
+			place_sa();
 		}
 
 		refseqs.clear();
@@ -466,7 +1162,10 @@ int main(int argc, char* argv[])
 			cerr<<"\n=================="<<endl;
 			cerr<<"begin alignment "<<begin<<"\n"<<endl;
 
-			if (loadall) { 
+			if (pipeline) {
+				pipe_take(slot);
+				refseqs.swap(slot.genomes);
+			}else if (inmem) { 
 				load_part_genomes_mem(allrefseqs, 
 					                    refseqs, 
 					                    totalgenomes, 
@@ -480,24 +1179,7 @@ int main(int argc, char* argv[])
 					                dchunk);
 			}
 			//Parallel part.
-			pthread_attr_t attr;  pthread_attr_init(&attr);
-			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-			vector<threads_arg> args(total_threads);
-			vector<pthread_t> thread_ids(total_threads);
-			// Initialize additional thread data.
-			for(int i = 0; i < total_threads; i++) 
-			{
-				args[i].skip = total_threads;
-				args[i].skip0 = i;
-				args[i].begin = cbegin;
-				args[i].part = false;
-				args[i].chunk = chunk;
-			}
-			//Create joinable threads to find MEMs.
-			for(int i = 0; i < total_threads; i++) 
-				pthread_create(&thread_ids[i], &attr, single_thread, (void *)&args[i]);
-			//Wait for all threads to terminate.
-			for(int i = 0; i < total_threads; i++) pthread_join(thread_ids[i], NULL);
+			run_pass(cbegin, chunk, false);
 			if ((long)refseqs.size()<dchunk){
 				getClusteringInfoOnepart(totalgenomes, 
 					                       begin, 
@@ -511,22 +1193,33 @@ int main(int argc, char* argv[])
 					                       false, 
 					                       clusterhit);
 			}
+			if (pipeline) {
+				set_ready(pipe_ready, begin+(long)refseqs.size());
+			}
 			if ((long)refseqs.size()<dchunk) { break; }
 			begin+=dchunk;
 			refseqs.clear();
 		}
-		delete saa;
+		free_sa();
+		delete ctext; ctext = NULL;
 		refseqs.clear();
 		cbegin=cbegin+chunk;
 
 	}//end while(1)
+	if (pipeline){ pthread_join(pipe_id, NULL); }
+	pool_stop();
 
 	//testDistanceBgenomes(totalgenomes); 
 	// Collect clustering information.
 	cerr<<"\n==========================="<<endl; 
 	cerr<<"Output clustering information ......\n"<<endl;
 	// Output with CD-HIT format.
-	outputClusteringInfoSimple(totalgenomes); 
+	if (mpi_rank==0){ outputClusteringInfoSimple(totalgenomes); }
+#ifdef GCLUST_MPI
+	free_sa(); // Its shared window must go before MPI.
+	MPI_Comm_free(&node_comm);
+	MPI_Finalize();
+#endif
 	cerr<<"The finish.\n"<<endl;
         end=time(NULL);
         cerr<<"time:"<<end-start<<" s"<<endl;
@@ -551,19 +1244,28 @@ void usage(string prog)
 	cerr << "-nchunk        Set the chunk number loaded one time for remaining genomes alignment, default = 2" << endl;
 	cerr << "-loadall       Load the total genomes one time" << endl;
 	cerr << "-rebuild       Rebuild suffix array after clustering into one chunk, default = 1" << endl;
+	cerr << "-bufmem        Set the memory budget of the match buffers of all threads, matches past it are spilled to a temporary file and read back a batch of references at a time, a reference with more matches than fit is read whole, default = 2048, where the unit is MB" << endl;
+	cerr << "-numa          Set the placement of the suffix array on NUMA nodes, where '0' means default, '1' means interleaved over the nodes and '2' means one copy per node, default = 0" << endl;
+	cerr << "-store         Convert the genomes file once into the binary store <genomes-file>.gcs and read the genomes from it, later runs skip FASTA parsing" << endl;
+	cerr << "-hugepages     Allocate the suffix array on 2 MB pages, from the hugetlb pool or else transparent huge pages" << endl;
+	cerr << "-pipeline      Load the next block of genomes while the current one is clustered, not used with -loadall" << endl;
+	cerr << "-prebuild      Build the suffix array of the next chunk during the remaining genomes alignment, implies -pipeline, needs memory for two suffix arrays" << endl;
 	cerr << endl;
   cerr << "Clustering cutoff:" << endl;
 	cerr << endl;
 	cerr << "-memiden       Set the value of extended maximal exact match (MEM) idendity or non-extended MEM idendity for clustering, default = 90" << endl;
+	cerr << "-rank          Evaluate candidate references in decreasing order of MEM coverage, a genome may join another representative and the number of clusters may change, default = reference order" << endl;
+	cerr << "-online        Compare a chunk genome only with the representatives decided before it, up to the first hit, same clustering" << endl;
   cerr << endl;
 	cerr << "Extension options of MEM:" << endl;
 	cerr << endl;
-	cerr << "-ext       Set the extension type of MEM, where '0' means no extension, '1' means gapped extension and '2' means un-gapped extension, default = 1" << endl;
+	cerr << "-ext       Set the extension type of MEM, where '0' means no extension, '1' means gapped extension, '2' means un-gapped extension and '3' means un-gapped extension on packed words (same results as '2'), default = 1" << endl;
 	cerr << "-mas       Set the reward value for a nucleotide match, default = 1" << endl;
 	cerr << "-umas      Set the penalty value for a nucleotide mismatch, default = -1" << endl;
 	cerr << "-gapo      Set the cost value to open a gap, default = -1" << endl;
 	cerr << "-gape      Set the cost value to extend a gap, default = -1" << endl;
 	cerr << "-drops     Set the X dropoff value for extension, default = 1" << endl;
+	cerr << "-lazyext   Stop extending a pair once it reaches the identity cutoff, the reported identity is then a lower bound" << endl;
 	cerr << endl;
   cerr << "Example usage:" << endl;
   cerr << endl;
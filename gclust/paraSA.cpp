@@ -6,7 +6,10 @@
 #include<stdio.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "fasta.hpp"
 #include "paraSA.hpp"
@@ -44,16 +47,354 @@ bool compareg1(const mumi_unit lhs, const mumi_unit rhs)
 
 };
 
+// Compute Mems identity of query id against one reference from the
+// reference's units, returns -1 when no unit survives filtering.
+double PairMemIdentity(vector<GenomeClustInfo> &totalgenomes,
+											 genome_cache &genomes,
+											 ext_seq const *query,
+											 const mumi_unit *units,
+											 long nunits,
+											 mem_scratch &scratch,
+											 long id,
+											 long iref,
+											 char strand,
+											 double miniden,
+											 bool lazy,
+											 int ext, //extension options
+											 int mas,
+											 int umas,
+											 int gapo,
+											 int gape,
+											 int drops)
+{
+	// Reused per-thread containers.
+	vector<mumi_unit> &singleunits = scratch.singleunits;
+	vector<mumi_unit> &removes = scratch.removes;
+	vector<mumi_unit> &dremoves = scratch.dremoves;
+	vector<mumi_unit> &ddremoves = scratch.ddremoves;
+	vector<mumi_unit> &mergeunits = scratch.mergeunits;
+
+	scratch.reset();
+	// Collect single ref genome matches.
+	singleunits.assign(units, units+nunits);
+
+	// Sort matches base on ref genome.
+	sort(singleunits.begin(), singleunits.end(),compareg0);
+	collectg0(singleunits);
+
+	// Sort matches base on query genome.
+	sort(singleunits.begin(), singleunits.end(),compareg1);
+
+	collectg1(singleunits);
+
+	// Remove symetrical matches.
+	Remove_symetrically(singleunits,removes);
+	sort(removes.begin(), removes.end(), compareg0);
+
+	doublecollectg0(removes);
+	sort(removes.begin(), removes.end(), compareg1);
+
+	doublecollectg1(removes);
+
+	Remove_symetrically(removes,dremoves);
+	sort(dremoves.begin(), dremoves.end(), compareg0);
+	trimendg0(dremoves);
+
+	//preG1_postG0
+	sort(dremoves.begin(), dremoves.end(),compareg1);
+	Remove_symetrically(dremoves,ddremoves);
+
+	//treat_chG1
+	sort(ddremoves.begin(), ddremoves.end(),compareg1);
+	trimendg1(ddremoves);
+
+	//continue if no unit
+	if ((long)ddremoves.size()==0){ return -1; }
+
+	//merge near units for extension
+	merging(ddremoves, mergeunits);
+
+	if ((ext!=0)&&(query!=NULL)){
+		//seed extension part | checking and extending
+		seedextensions(mergeunits, genomes.seqs[iref], *query, scratch, 
+									 totalgenomes[id].size, miniden, lazy, 
+									 ext, mas, umas, gapo, gape, drops);
+	}
+
+	return tell_me(mergeunits,totalgenomes[id].size);
+
+}
+
+// Query bases the units of one reference can cover once extended. The
+// filtered units keep the start and the diagonal of a raw unit, and the
+// extensions only fill the query between them, so the covered bases lie
+// within the span the raw diagonals reach inside the reference. Gapped
+// extension may leave the diagonal, but every query base past the 
+// reference bases costs gape and X-drop keeps no cell below -drops, so
+// over n reference bases it reaches at most (s*n+drops)/-gape more.
+static long ExtensionSpan(const mumi_unit *units,
+													long nunits,
+													long qsize,
+													long rsize,
+													int ext, 
+													int mas,
+													int umas,
+													int gape,
+													int drops)
+{
+	long lo=qsize, hi=1;
+	double s=max(max(mas, umas), 0);
+	if ((ext==1)&&(gape>=0)){ return qsize; }
+	for (long j=0;j<nunits;j++)
+	{
+		const mumi_unit &mu=units[j];
+		long left=mu.g0init-1, right=rsize-mu.g0init+1;
+		double slackleft=0, slackright=0;
+		if (ext==1)
+		{
+			slackleft=(s*left+drops)/(-gape);
+			slackright=(s*right+drops)/(-gape);
+		}
+		long diag=mu.g1init-mu.g0init;
+		lo=min(lo, diag+1-(long)slackleft);
+		hi=max(hi, diag+rsize+(long)slackright);
+	}
+	lo=max(lo, 1L);
+	hi=min(hi, qsize);
+	return (hi>=lo) ? hi-lo+1 : 0;
+
+}
+
+// Bucket the query's units by reference and build the candidate list.
+// References that can not reach miniden are pruned: raw MEM coverage 
+// bounds the identity without extension, the extension span with it.
+void RankMemCandidates(vector<GenomeClustInfo> &totalgenomes,
+											 vector<mumi_unit> &mumiunits,
+											 mem_scratch &scratch,
+											 long beginclust,
+											 long sid,
+											 long qsize,
+											 double miniden,
+											 bool rank,
+											 int ext,
+											 int mas,
+											 int umas,
+											 int gape,
+											 int drops)
+{
+	long nref = sid-beginclust;
+	vector<long> &bucketpos = scratch.bucketpos;
+	vector<long> &coverage = scratch.coverage;
+	vector<long> &candidates = scratch.candidates;
+	vector<mumi_unit> &bucketed = scratch.bucketed;
+
+	bucketpos.assign(nref+1, 0);
+	coverage.assign(nref, 0);
+	candidates.clear();
+	for (long j=0;j<(long)mumiunits.size();j++)
+	{
+		long r = mumiunits[j].ref-beginclust;
+		if ((r<0)||(r>=nref)){ continue; }
+		bucketpos[r+1]++;
+		coverage[r]+=mumiunits[j].g0long;
+	}
+	for (long r=0;r<nref;r++){ bucketpos[r+1]+=bucketpos[r]; }
+	// Stable placement keeps the units of one reference in search order.
+	bucketed.resize(bucketpos[nref]);
+	for (long j=0;j<(long)mumiunits.size();j++)
+	{
+		long r = mumiunits[j].ref-beginclust;
+		if ((r<0)||(r>=nref)){ continue; }
+		bucketed[bucketpos[r]++]=mumiunits[j];
+	}
+	for (long r=nref;r>0;r--){ bucketpos[r]=bucketpos[r-1]; }
+	bucketpos[0]=0;
+
+	for (long r=0;r<nref;r++)
+	{
+		if (bucketpos[r+1]==bucketpos[r]){ continue; }
+		long bound=coverage[r];
+		if (ext!=0)
+		{
+			bound=ExtensionSpan(&bucketed[0]+bucketpos[r], bucketpos[r+1]-bucketpos[r], 
+													qsize, totalgenomes[beginclust+r].size, 
+													ext, mas, umas, gape, drops);
+		}
+		if ((double)bound/qsize < miniden){ continue; }
+		candidates.push_back(r);
+	}
+	if (rank)
+	{
+		stable_sort(candidates.begin(), candidates.end(), coverage_greater(coverage));
+	}
+
+}
+
+// Per-reference identity tasks of one query strand. The owner publishes
+// the job in the identity pool so threads without queries of their own
+// can take references from it.
+struct iden_job
+{
+	vector<GenomeClustInfo> *totalgenomes;
+	genome_cache *genomes;
+	ext_seq const *query; // Query on the job's strand, NULL without extension.
+	mem_scratch *owner; // Bucketed units, candidates and distances.
+	long beginclust;
+	long id;
+	char strand;
+	bool part;
+	double miniden;
+	bool lazy;
+	int ext, mas, umas, gapo, gape, drops;
+	volatile long next; // Next candidate to claim.
+	volatile long first; // Lowest hitting candidate, later ones are cancelled.
+	long helpers; // Helpers inside the job, guarded by iden_lock.
+
+};
+
+static pthread_mutex_t iden_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t iden_cond = PTHREAD_COND_INITIALIZER;
+static vector<iden_job *> iden_jobs; // Open jobs.
+static int iden_running = 0; // Workers still busy with their own queries.
+static volatile int iden_idle = 0; // Workers waiting for jobs.
+
+// Claim and evaluate candidates until the job is exhausted. Candidates
+// are claimed in order, so in non-part mode every candidate before the
+// first hit is evaluated and the outcome equals the serial loop.
+static void iden_job_run(iden_job &job, mem_scratch &scratch)
+{
+	mem_scratch &owner = *job.owner;
+	long n = (long)owner.candidates.size();
+	while (1)
+	{
+		long c = __sync_fetch_and_add(&job.next, 1);
+		if ((c >= n)||(c > job.first)){ break; }
+		long r = owner.candidates[c];
+		double distance=PairMemIdentity(*job.totalgenomes, *job.genomes, job.query, 
+																		&owner.bucketed[0]+owner.bucketpos[r], 
+																		owner.bucketpos[r+1]-owner.bucketpos[r], 
+																		scratch, job.id, job.beginclust+r, job.strand, 
+																		job.miniden, job.lazy, 
+																		job.ext, job.mas, job.umas, job.gapo, job.gape, job.drops);
+		owner.distances[c]=distance;
+		if ((!job.part)&&(distance >= job.miniden))
+		{
+			long f = job.first;
+			while ((c < f)&&(!__sync_bool_compare_and_swap(&job.first, f, c))){ f = job.first; }
+		}
+	}
+}
+
+// Remove a job from the open list if it is still there.
+static void iden_job_close(iden_job *job)
+{
+	for (long j=0;j<(long)iden_jobs.size();j++)
+	{
+		if (iden_jobs[j]==job)
+		{
+			iden_jobs.erase(iden_jobs.begin()+j);
+			return;
+		}
+	}
+}
+
+// Start a pass with the given number of workers.
+void iden_pool_begin(int workers)
+{
+	pthread_mutex_lock(&iden_lock);
+	iden_running = workers;
+	pthread_mutex_unlock(&iden_lock);
+}
+
+// Called by a worker that ran out of queries: help the remaining jobs
+// until every worker of the pass is done.
+void iden_pool_help(mem_scratch &scratch)
+{
+	pthread_mutex_lock(&iden_lock);
+	iden_running--;
+	pthread_cond_broadcast(&iden_cond);
+	while (1)
+	{
+		if (!iden_jobs.empty())
+		{
+			iden_job *job = iden_jobs.front();
+			if (job->next >= (long)job->owner->candidates.size())
+			{
+				// Nothing left to claim.
+				iden_job_close(job);
+				continue;
+			}
+			job->helpers++;
+			pthread_mutex_unlock(&iden_lock);
+			iden_job_run(*job, scratch);
+			pthread_mutex_lock(&iden_lock);
+			job->helpers--;
+			iden_job_close(job);
+			pthread_cond_broadcast(&iden_cond);
+			continue;
+		}
+		if (iden_running == 0){ break; }
+		iden_idle++;
+		pthread_cond_wait(&iden_cond, &iden_lock);
+		iden_idle--;
+	}
+	pthread_mutex_unlock(&iden_lock);
+}
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER; // A state was decided.
+static int state_waiters = 0; // Threads asleep on state_cond.
+const int STATE_SPIN = 64; // Yields before a waiter sleeps.
+
+// Note: a decision usually follows shortly, so the waiter yields a few
+// times first; one that may take an extension or more sleeps until the
+// next decision. The waiter count is raised before the state is read
+// again, so either the publisher sees it or the waiter sees the state.
+char wait_state(char *state)
+{
+	char s;
+	for (int i=0; i<STATE_SPIN; i++)
+	{
+		s = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+		if (s != REF_PENDING){ return s; }
+		sched_yield();
+	}
+	pthread_mutex_lock(&state_lock);
+	__atomic_add_fetch(&state_waiters, 1, __ATOMIC_SEQ_CST);
+	while ((s = __atomic_load_n(state, __ATOMIC_SEQ_CST)) == REF_PENDING)
+	{
+		pthread_cond_wait(&state_cond, &state_lock);
+	}
+	__atomic_sub_fetch(&state_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&state_lock);
+	return s;
+}
+
+void publish_state(char *state, char value)
+{
+	__atomic_store_n(state, value, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&state_waiters, __ATOMIC_SEQ_CST) > 0)
+	{
+		pthread_mutex_lock(&state_lock);
+		pthread_cond_broadcast(&state_cond);
+		pthread_mutex_unlock(&state_lock);
+	}
+}
+
 // Compute Mems identity.
 bool ComputeMemIdentity(vector<GenomeClustInfo> &totalgenomes,
-												vector<Genome> &allpartgenomes,
+												genome_cache &genomes,
 												vector<mumi_unit> &mumiunits, 
+												mem_scratch &scratch,
 												long beginclust, 
 												long id,
 												int MEMiden, 
 												bool part, 
 												long chunk, 
 												char strand,
+												bool rank,
+												bool lazy,
+												char *refstate,
 												int ext, //extension options
 												int mas,
 												int umas,
@@ -63,11 +404,10 @@ bool ComputeMemIdentity(vector<GenomeClustInfo> &totalgenomes,
 {
 
 	double miniden;
-	double distance;
 	bool hitted = false;
-	long addsize, sid;
+	bool extending;
+	long sid, ncand;
 
-	vector<mumi_unit> singleunits;
 	miniden=(double)MEMiden/100;
 
 	if (!part){
@@ -76,81 +416,106 @@ bool ComputeMemIdentity(vector<GenomeClustInfo> &totalgenomes,
 		sid=id;
 	}
 
-	for (long i=beginclust;i<sid;i++)
+	// Without sequences seedextensions leaves the units untouched.
+	extending = (ext!=0)&&(genomes.seqs.size()!=0);
+	RankMemCandidates(totalgenomes, mumiunits, scratch, beginclust, sid, 
+										totalgenomes[id].size, miniden, rank, 
+										(extending) ? ext : 0, mas, umas, gape, drops);
+
+	ncand = (long)scratch.candidates.size();
+	scratch.distances.assign(ncand, -1);
+
+	iden_job job;
+	job.totalgenomes = &totalgenomes;
+	job.genomes = &genomes;
+	job.query = NULL;
+	job.owner = &scratch;
+	job.beginclust = beginclust;
+	job.id = id;
+	job.strand = strand;
+	job.part = part;
+	job.miniden = miniden;
+	job.lazy = lazy;
+	job.ext = ext; job.mas = mas; job.umas = umas;
+	job.gapo = gapo; job.gape = gape; job.drops = drops;
+	job.next = 0;
+	job.first = ncand;
+	job.helpers = 0;
+
+	if ((extending)&&(ncand > 0))
 	{
+		// Reverse complement the query once for all references.
+		if (strand == '-')
+		{
+			reverse_codes(genomes.seqs[id].codes, scratch.qrc.codes);
+			if (ext==3){ pack_codes(scratch.qrc); }
+			job.query = &scratch.qrc;
+		}else{
+			job.query = &genomes.seqs[id];
+		}
+	}
 
-		addsize=0;
-		singleunits.clear();
-
-		// Collect single ref genome matches.
-		for (long j=0;j<(long)mumiunits.size();j++){
-			if (mumiunits[j].ref==i){
-				singleunits.push_back(mumiunits[j]);
-				addsize+=mumiunits[j].g0long;
+	if ((part)&&(refstate!=NULL))
+	{
+		// Note: online part clustering. A reference still pending comes
+		// earlier in the chunk and is waited for, clustered ones are 
+		// skipped, so the first hit is the one the serial resolution of
+		// getClusteringInfoOnepart would pick.
+		for (long c=0;c<ncand;c++)
+		{
+			long r = scratch.candidates[c];
+			if (wait_state(&refstate[beginclust+r])!=REF_REP){ continue; }
+			double distance=PairMemIdentity(totalgenomes, genomes, job.query, 
+																			&scratch.bucketed[0]+scratch.bucketpos[r], 
+																			scratch.bucketpos[r+1]-scratch.bucketpos[r], 
+																			scratch, id, beginclust+r, strand, 
+																			miniden, lazy, 
+																			ext, mas, umas, gapo, gape, drops);
+			if (distance >= miniden)
+			{
+				hit_edge e;
+				e.query=id;
+				e.h.id=beginclust+r;
+				e.h.strand=strand;
+				e.h.identity=distance;
+				scratch.hits.push_back(e);
+				return true;
 			}
 		}
+		return false;
+	}
 
-		//if ((double)addsize/totalgenomes[id].size < miniden ){ continue; }
-
-		// Sort matches base on ref genome.
-		sort(singleunits.begin(), singleunits.end(),compareg0);
-		collectg0(singleunits);
-
-		// Sort matches base on query genome.
-		sort(singleunits.begin(), singleunits.end(),compareg1);
-
-		collectg1(singleunits);
-		vector<mumi_unit> removes;
-
-		// Remove symetrical matches.
-		Remove_symetrically(singleunits,removes);
-		sort(removes.begin(), removes.end(), compareg0);
-
-		doublecollectg0(removes);
-		sort(removes.begin(), removes.end(), compareg1);
-
-		doublecollectg1(removes);
-		vector<mumi_unit> dremoves;
-
-		Remove_symetrically(removes,dremoves);
-		sort(dremoves.begin(), dremoves.end(), compareg0);
-		trimendg0(dremoves);
-
-		//preG1_postG0
-		sort(dremoves.begin(), dremoves.end(),compareg1);
-		vector<mumi_unit> ddremoves;
-		Remove_symetrically(dremoves,ddremoves);
-
-		//treat_chG1
-		sort(ddremoves.begin(), ddremoves.end(),compareg1);
-		trimendg1(ddremoves);
-
-		//continue if no unit
-		if ((long)ddremoves.size()==0){ continue; }
-
-		//merge near units for extension
-		vector<mumi_unit> mergeunits;
-	  merging(ddremoves, mergeunits);
+	// Share the references only when somebody is waiting for work.
+	if ((ncand > 1)&&(iden_idle > 0))
+	{
+		pthread_mutex_lock(&iden_lock);
+		iden_jobs.push_back(&job);
+		pthread_cond_broadcast(&iden_cond);
+		pthread_mutex_unlock(&iden_lock);
 
-		if (ext!=0){
-			//seed extension part | checking and extending
-			seedextensions(mergeunits, allpartgenomes, id, i, strand, 
-										 ext, mas, umas, gapo, gape, drops);
-		}
+		iden_job_run(job, scratch);
 
-		distance=tell_me(mergeunits,totalgenomes[id].size);
+		pthread_mutex_lock(&iden_lock);
+		iden_job_close(&job);
+		while (job.helpers > 0){ pthread_cond_wait(&iden_cond, &iden_lock); }
+		pthread_mutex_unlock(&iden_lock);
+	}else{
+		iden_job_run(job, scratch);
+	}
 
-		//loading clustering info
-		if (distance >= miniden){
-			hit thit;
-			thit.id=i;
-			thit.strand=strand;
-			thit.identity=distance;
-			totalgenomes[id].clusters.push_back(thit);
+	// Loading clustering info in candidate order.
+	for (long c=0;c<ncand;c++)
+	{
+		if (scratch.distances[c] >= miniden){
+			hit_edge e;
+			e.query=id;
+			e.h.id=beginclust+scratch.candidates[c];
+			e.h.strand=strand;
+			e.h.identity=scratch.distances[c];
+			scratch.hits.push_back(e);
 			hitted=true;
 			if (!part){ break; } // Hitted and exit
 		} // Do MuMi computing.
-
 	}
 
 	return hitted;
@@ -349,12 +714,187 @@ double tell_me(vector<mumi_unit> &ddremoves,long size)
 	return (double)add/size;
 }
 
-// Seed extension with two directions
+// Left extension of unit i, the gap starts after g1leftbegin (the
+// previous unit's end). Returns the extension length. With a lane the
+// ungapped walk is only described there, for a batched run.
+static long extend_left(vector<mumi_unit> &ddremoves,
+												long i,
+												long g1leftbegin,
+												ext_seq const &seq0,
+												ext_seq const &seq1,
+												xdrop_buf &buf,
+												xdrop_lane *lane,
+												int ext, //extension options
+												int mas,
+												int umas,
+												int gape,
+												int drops)
+{
+	long g1leftband;
+	long g0infixbegin, g1infixbegin;
+	long g0infixend;
+	long extensionlen;
+	mumi_unit &tmu0 = ddremoves[i];
+
+	g1infixbegin = g1leftbegin;
+	//length of candidate extension part
+	g1leftband=tmu0.g1init-g1leftbegin-1;
+	if (tmu0.g0init > (g1leftband+10))
+	{
+		g0infixbegin=tmu0.g0init-g1leftband-10-1;
+	}else{
+		g0infixbegin=0;
+	}
+
+	g0infixend=tmu0.g0init;
+	//get infix part instead whole sequence for extension
+	const char *infix0 = seq0.codes.data()+g0infixbegin;
+	const char *infix1 = seq1.codes.data()+g1infixbegin;
+	
+	long seedbegin0;
+	if (g0infixbegin==0)
+	{
+		seedbegin0=g0infixend-1;
+	}else{
+		seedbegin0=g1leftband+10;
+	}
+
+	//seed of length 1 at (seedbegin0, g1leftband), extended leftwards
+	//Gapped or ungapped extension
+	if (ext==1){
+		// Note: seqan compares the seed with the absolute infix begin,
+		// kept as is so the extension lengths do not change.
+		if ((seedbegin0 != g0infixbegin) && (g1leftband != g1infixbegin))
+		{
+			extensionlen=xdrop_gapped(infix0, seedbegin0, infix1, g1leftband, true, 
+																mas, umas, gape, drops, buf);
+		}else{
+			extensionlen=0;
+		}
+	}else if (ext==3){
+		extensionlen=xdrop_ungapped_packed(&seq0.words[0], g0infixbegin+seedbegin0-1, 
+																			 &seq1.words[0], g1infixbegin+g1leftband-1, 
+																			 min(seedbegin0, g1leftband), -1, 
+																			 mas, umas, drops);
+	}else if (lane != NULL){
+		lane->xpos = g0infixbegin+seedbegin0-1;
+		lane->ypos = g1infixbegin+g1leftband-1;
+		lane->n = min(seedbegin0, g1leftband);
+		return 0;
+	}else{
+		extensionlen=xdrop_ungapped(infix0+seedbegin0-1, infix1+g1leftband-1, 
+																min(seedbegin0, g1leftband), -1, 
+																mas, umas, drops);
+	}
+
+	tmu0.g1init-=extensionlen;
+	tmu0.g1long+=extensionlen;
+
+	//global alignment of extension part | if need
+	/*
+	Align<Infix<DnaString>::Type > align;
+	resize(rows(align), 2);
+	assignSource(row(align, 0), infix(infix0, leftPosition(seed, 0), \
+		rightPosition(seed, 0)+1));
+	assignSource(row(align, 1), infix(infix1, leftPosition(seed, 1), \
+		rightPosition(seed, 1)+1));
+	std::cout << std::endl << "Banded Alignment:" << std::endl;
+	std::cout << "Score: " << globalAlignment(align, stringSet(align), scoreMatrix, \
+		-leftDiagonal(seed) - 2, -rightDiagonal(seed) + 2, \
+		BandedNeedlemanWunsch()) << std::endl;
+	std::cout << align;
+	*/
+
+	return extensionlen;
+}
+
+// Right extension of unit i up to g1rightend (before the next unit).
+// Returns the extension length, lanes as for extend_left.
+static long extend_right(vector<mumi_unit> &ddremoves,
+												 long i,
+												 long g1rightend,
+												 ext_seq const &seq0,
+												 ext_seq const &seq1,
+												 xdrop_buf &buf,
+												 xdrop_lane *lane,
+												 int ext, //extension options
+												 int mas,
+												 int umas,
+												 int gape,
+												 int drops)
+{
+	long g1rightband;
+	long g0infixbegin, g1infixbegin;
+	long g0infixend, g1infixend;
+	long extensionlen;
+	mumi_unit &tmu0 = ddremoves[i];
+
+	g1infixbegin = tmu0.g1fin-1;
+	g0infixbegin = tmu0.g0fin-1;
+	g1rightband=g1rightend-tmu0.g1fin+2;
+
+	g0infixend = g0infixbegin+g1rightband+10;
+	// Keep the window inside the reference, nothing to extend when
+	// the unit already ends at the last reference base.
+	if (g0infixend > (long)seq0.codes.size()){ g0infixend = seq0.codes.size(); }
+	if (g0infixend-g0infixbegin < 2)
+	{
+		if (lane != NULL){ lane->xpos = lane->ypos = lane->n = 0; }
+		return 0;
+	}
+	g1infixend = g1infixbegin+g1rightband;
+	
+	const char *infix0 = seq0.codes.data()+g0infixbegin;
+	const char *infix1 = seq1.codes.data()+g1infixbegin;
+	long infixlen0 = g0infixend-g0infixbegin;
+	long infixlen1 = g1infixend-g1infixbegin;
+
+	//seed of length 1 at (0, 0), extended rightwards
+	//Gapped or ungapped extension
+	if (ext==1){
+		if ((1 < g0infixend) && (1 < g1infixend))
+		{
+			extensionlen=xdrop_gapped(infix0+1, infixlen0-1, infix1+1, infixlen1-1, false, 
+																mas, umas, gape, drops, buf);
+		}else{
+			extensionlen=0;
+		}
+	}else if (ext==3){
+		extensionlen=xdrop_ungapped_packed(&seq0.words[0], g0infixbegin+1, 
+																			 &seq1.words[0], g1infixbegin+1, 
+																			 min(infixlen0, infixlen1)-1, 1, 
+																			 mas, umas, drops);
+	}else if (lane != NULL){
+		lane->xpos = g0infixbegin+1;
+		lane->ypos = g1infixbegin+1;
+		lane->n = min(infixlen0, infixlen1)-1;
+		return 0;
+	}else{
+		extensionlen=xdrop_ungapped(infix0+1, infix1+1, 
+																min(infixlen0, infixlen1)-1, 1, 
+																mas, umas, drops);
+	}
+
+	//update unit info
+	tmu0.g1fin+=extensionlen;
+	tmu0.g1long+=extensionlen;
+
+	return extensionlen;
+}
+
+// Seed extension with two directions. Gaps are extended largest first,
+// all left extensions before the right ones (a right gap ends where the
+// next unit's left extension stopped). Ungapped gaps are extended
+// XDROP_LANES at a time, the stop checks run after each batch. Extension stops once the gaps
+// left can no longer lift the coverage to miniden, such a pair fails
+// either way; with lazy it also stops once the coverage passes.
 void seedextensions(vector<mumi_unit> &ddremoves,
-									 vector<Genome> &allpartgenomes,
-									 long id, 
-									 long iref, 
-									 char strand,
+									 ext_seq const &seq0,
+									 ext_seq const &seq1,
+									 mem_scratch &scratch,
+									 long qsize,
+									 double miniden,
+									 bool lazy,
 									 int ext, //extension options
 									 int mas,
 									 int umas,
@@ -365,181 +905,220 @@ void seedextensions(vector<mumi_unit> &ddremoves,
 {
 	// Total Units 
 	long units=(long)ddremoves.size();
-	long g1leftband, g1rightband;
 	long g1leftbegin=0;
-	long g0infixbegin, g1infixbegin;
-	long g0infixend, g1infixend;
-	long seedfrom, seedto;
-	long extensionlen;
 	long g1rightend;
-  mumi_unit tmu0;
+	long coverage=0, potential=0;
+	vector<pair<long, long> > &gaps = scratch.gaps;
+	vector<xdrop_lane> &lanes = scratch.lanes;
+	long batch = (ext==2) ? XDROP_LANES : 1;
 	
-	// For right extension
-	//g1rightend = allpartgenomes[id].size-1;
-
-	// Get DNA content
-	DnaString seq0, seq1;
-	if(allpartgenomes.size() != 0) 
-	{//add judgment statement for variable allpartgenomes
-		seq0 = allpartgenomes[iref].cont;
-		seq1 = allpartgenomes[id].cont;
-	}
-	else
+	// Reference and query (already on the right strand) are read-only
+	// views shared by all threads.
+
+	for (long i=0; i<units;i++)
 	{
-		return; 
+		coverage+=ddremoves[i].g1long;
 	}
+	if ((lazy)&&((double)coverage/qsize >= miniden)){ return; }
 
-
-	// Get reverse complement DNA sequence 
-	if (strand == '-')
+	// left gaps, (-length, unit) so the largest come first
+	gaps.clear();
+	for (long i=0; i<units;i++)
+	{
+		if ( (ddremoves[i].g1init-2) > g1leftbegin )
+		{
+			gaps.push_back(make_pair(g1leftbegin-ddremoves[i].g1init+1, i));
+			potential+=ddremoves[i].g1init-g1leftbegin-1;
+		}
+		g1leftbegin = ddremoves[i].g1fin;
+	}
+	// right gaps can only shrink by the left extensions
+	g1rightend = (long)seq1.codes.size()-1;
+	for (long i=(units-1); i>=0; i--)
 	{
-		reverseComplement(seq1);
+		if ( (ddremoves[i].g1fin+2) < g1rightend ) 
+		{
+			potential+=g1rightend-ddremoves[i].g1fin+1;
+		}
+		g1rightend = ddremoves[i].g1init-2;
 	}
+	if ((double)(coverage+potential)/qsize < miniden){ return; }
 
 	// left seed extension part
-	for (long i=0; i<units;i++)
+	sort(gaps.begin(), gaps.end());
+	for (long j=0; j<(long)gaps.size(); j+=batch)
 	{
-
-		/*
-		cout<<ddremoves[i].ref<<"\t"<<
-					id<<"\t"<<
-					ddremoves[i].g0sens<<"\t"<<
-					ddremoves[i].g0init<<"\t"<<
-					ddremoves[i].g0long<<"\t"<<
-					ddremoves[i].g0fin<<"\t"<<
-					ddremoves[i].g1sens<<"\t"<<
-					ddremoves[i].g1init<<"\t"<<
-					ddremoves[i].g1long<<"\t"<<
-					ddremoves[i].g1fin<<"\t"<<" | ";
-		//cout<<endl;
-		*/
-
-		tmu0 = ddremoves[i];
-		//left extension
-		if ( (tmu0.g1init-2) > g1leftbegin )
+		long cnt = min(batch, (long)gaps.size()-j);
+		lanes.resize(cnt);
+		for (long l=0; l<cnt; l++)
 		{
-			g1infixbegin = g1leftbegin;
-			//length of candidate extension part
-			g1leftband=tmu0.g1init-g1leftbegin-1;
-			if (tmu0.g0init > (g1leftband+10))
-			{
-				g0infixbegin=tmu0.g0init-g1leftband-10-1;
-			}else{
-				g0infixbegin=0;
-			}
-
-			g1infixend=tmu0.g1init;
-			g0infixend=tmu0.g0init;
-			//get infix part instead whole sequence for extension
-			typedef Infix<DnaString>::Type TInfix;
-			TInfix infix0 = infix(seq0, g0infixbegin, g0infixend);
-			TInfix infix1 = infix(seq1, g1infixbegin, g1infixend);
-			
-			long seedbegin0;
-			if (g0infixbegin==0)
+			long i = gaps[j+l].second;
+			g1leftbegin = (i > 0) ? ddremoves[i-1].g1fin : 0;
+			coverage+=extend_left(ddremoves, i, g1leftbegin, seq0, seq1, scratch.xdrop, 
+														(ext==2) ? &lanes[l] : NULL, 
+														ext, mas, umas, gape, drops);
+			potential+=gaps[j+l].first;
+		}
+		if (ext==2)
+		{
+			xdrop_ungapped_batch(seq0.codes.data(), seq0.codes.size(), 
+													 seq1.codes.data(), seq1.codes.size(), 
+													 &lanes[0], cnt, -1, mas, umas, drops);
+			for (long l=0; l<cnt; l++)
 			{
-				seedbegin0=g0infixend-1;
-			}else{
-				seedbegin0=g1leftband+10;
-			}
-
-			typedef Seed<> TSeed;
-			TSeed seed(seedbegin0, g1leftband, 1);
-			seedfrom=leftPosition(seed, 1);
-			//extension parameters 
-			typedef int TScore;
-			
-			//Score<TScore, Simple> scoreMatrix(1, -1, -1);
-			//TScore scoreDropOff = 1;
-			Score<TScore, Simple> scoreMatrix(mas, umas, gape, gapo);
-			TScore scoreDropOff = drops;
-
-			//Gapped or ungapped extension
-			if (ext==1){
-				extendSeed(seed, scoreDropOff, scoreMatrix, infix0, infix1, 0, GappedXDrop());
-			}else{
-				extendSeed(seed, scoreDropOff, scoreMatrix, infix0, infix1, 0, UngappedXDrop());
+				long i = gaps[j+l].second;
+				ddremoves[i].g1init-=lanes[l].ext;
+				ddremoves[i].g1long+=lanes[l].ext;
+				coverage+=lanes[l].ext;
 			}
-
-			seedto=leftPosition(seed, 1);
-			extensionlen=seedfrom-seedto;
-			ddremoves[i].g1init-=extensionlen;
-			ddremoves[i].g1long+=extensionlen;
-
-			//global alignment of extension part | if need
-			/*
-			Align<Infix<DnaString>::Type > align;
-			resize(rows(align), 2);
-			assignSource(row(align, 0), infix(infix0, leftPosition(seed, 0), \
-				rightPosition(seed, 0)+1));
-			assignSource(row(align, 1), infix(infix1, leftPosition(seed, 1), \
-				rightPosition(seed, 1)+1));
-			std::cout << std::endl << "Banded Alignment:" << std::endl;
-			std::cout << "Score: " << globalAlignment(align, stringSet(align), scoreMatrix, \
-				-leftDiagonal(seed) - 2, -rightDiagonal(seed) + 2, \
-				BandedNeedlemanWunsch()) << std::endl;
-			std::cout << align;
-			*/
 		}
-
-		g1leftbegin = tmu0.g1fin;
-
+		if ((double)(coverage+potential)/qsize < miniden){ return; }
+		if ((lazy)&&((double)coverage/qsize >= miniden)){ return; }
 	}
-	
+
 	//right extension part 
-	g1rightend = allpartgenomes[id].size-1;
+	gaps.clear();
+	potential=0;
+	g1rightend = (long)seq1.codes.size()-1;
 	for (long i=(units-1); i>=0; i--)
 	{
-		tmu0 = ddremoves[i];
-		//right extension 
 		//do extension only when gap >=3
-		if ( (tmu0.g1fin+2) < g1rightend ) 
+		if ( (ddremoves[i].g1fin+2) < g1rightend ) 
 		{
-			g1infixbegin = tmu0.g1fin-1;
-			g0infixbegin = tmu0.g0fin-1;
-			g1rightband=g1rightend-tmu0.g1fin+2;
-
-			g0infixend = g0infixbegin+g1rightband+10;
-			g1infixend = g1infixbegin+g1rightband;
-			
-			typedef Infix<DnaString>::Type TInfix;
-			TInfix infix0 = infix(seq0, g0infixbegin, g0infixend);
-			TInfix infix1 = infix(seq1, g1infixbegin, g1infixend);
-		
-			typedef Seed<> TSeed;
-			TSeed seed(0, 0, 1);
-
-			//extension parameters 
-			typedef int TScore;
-			//Score<TScore, Simple> scoreMatrix(1, -1, -1);
-			//TScore scoreDropOff = 1;
-			Score<TScore, Simple> scoreMatrix(mas, umas, gape, gapo);
-			TScore scoreDropOff = drops;
-			//Gapped or ungapped extension
-			if (ext==1){
-				extendSeed(seed, scoreDropOff, scoreMatrix, infix0, infix1, 1, GappedXDrop());
-			}else{
-				extendSeed(seed, scoreDropOff, scoreMatrix, infix0, infix1, 1, UngappedXDrop());
+			gaps.push_back(make_pair(ddremoves[i].g1fin-g1rightend-1, i));
+			potential+=g1rightend-ddremoves[i].g1fin+1;
+		}
+		g1rightend = ddremoves[i].g1init-2;
+	}
+	if ((double)(coverage+potential)/qsize < miniden){ return; }
+
+	sort(gaps.begin(), gaps.end());
+	for (long j=0; j<(long)gaps.size(); j+=batch)
+	{
+		long cnt = min(batch, (long)gaps.size()-j);
+		lanes.resize(cnt);
+		for (long l=0; l<cnt; l++)
+		{
+			long i = gaps[j+l].second;
+			g1rightend = (i < units-1) ? ddremoves[i+1].g1init-2 : (long)seq1.codes.size()-1;
+			coverage+=extend_right(ddremoves, i, g1rightend, seq0, seq1, scratch.xdrop, 
+														 (ext==2) ? &lanes[l] : NULL, 
+														 ext, mas, umas, gape, drops);
+			potential+=gaps[j+l].first;
+		}
+		if (ext==2)
+		{
+			xdrop_ungapped_batch(seq0.codes.data(), seq0.codes.size(), 
+													 seq1.codes.data(), seq1.codes.size(), 
+													 &lanes[0], cnt, 1, mas, umas, drops);
+			for (long l=0; l<cnt; l++)
+			{
+				long i = gaps[j+l].second;
+				ddremoves[i].g1fin+=lanes[l].ext;
+				ddremoves[i].g1long+=lanes[l].ext;
+				coverage+=lanes[l].ext;
 			}
+		}
+		if ((double)(coverage+potential)/qsize < miniden){ return; }
+		if ((lazy)&&((double)coverage/qsize >= miniden)){ return; }
+	}
 
-			extensionlen=rightPosition(seed, 1);
-			//update unit info
-			ddremoves[i].g1fin+=extensionlen;
-			ddremoves[i].g1long+=extensionlen;
+}
+
+// Convert the run's genomes once for seed extension, packed words
+// are only needed by the word-level ungapped extension.
+void build_genome_cache(vector<Genome> &allpartgenomes, genome_cache &genomes, bool packed)
+{
+	genomes.seqs.resize(allpartgenomes.size());
+	for (long i=0;i<(long)allpartgenomes.size();i++)
+	{
+		const char *cont = allpartgenomes[i].seq();
+		string &codes = genomes.seqs[i].codes;
+		codes.resize(allpartgenomes[i].size);
+		// Same base codes as seqan's Dna, unknown characters become A.
+		for (long j=0;j<(long)codes.size();j++)
+		{
+			codes[j] = (char)ordValue(Dna(cont[j]));
 		}
-		g1rightend = tmu0.g1init-2;
+		if (packed){ pack_codes(genomes.seqs[i]); }
+	}
+}
+
+// Reverse complement of 2-bit base codes.
+void reverse_codes(string const &codes, string &rc)
+{
+	long n=(long)codes.size();
+	rc.resize(n);
+	for (long j=0;j<n;j++)
+	{
+		rc[j] = (char)(3-codes[n-1-j]);
 	}
+}
+
+void *index_map(size_t bytes, size_t &len)
+{
+	if ((!hugepages)||(bytes < HUGE_PAGE)){ return NULL; }
+	len = (bytes+HUGE_PAGE-1) & ~(HUGE_PAGE-1);
+#ifdef MAP_HUGETLB
+	void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, 
+								 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (p!=MAP_FAILED){ return p; }
+#endif
+	// Note: no free hugetlb pages, map one huge page more and trim the 
+	// mapping to a 2 MB boundary so the kernel can back it with THP.
+	char *q = (char *)mmap(NULL, len+HUGE_PAGE, PROT_READ|PROT_WRITE, 
+												 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (q==(char *)MAP_FAILED){ return NULL; }
+	char *a = (char *)(((uintptr_t)q+HUGE_PAGE-1) & ~(uintptr_t)(HUGE_PAGE-1));
+	if (a>q){ munmap(q, a-q); }
+	if (q+HUGE_PAGE>a){ munmap(a+len, q+HUGE_PAGE-a); }
+#ifdef MADV_HUGEPAGE
+	madvise(a, len, MADV_HUGEPAGE);
+#endif
+	return a;
+}
 
+long hugepage_bytes(const void *p, size_t bytes)
+{
+	FILE *f = fopen("/proc/self/smaps", "r");
+	if (f==NULL){ return 0; }
+	uintptr_t lo = (uintptr_t)p, hi = lo+bytes, start = 0, end = 0;
+	long total = 0, vma = 0, kb;
+	char line[512], key[64];
+	while (fgets(line, sizeof(line), f)!=NULL)
+	{
+		unsigned long s, e;
+		if (sscanf(line, "%lx-%lx ", &s, &e)==2)
+		{
+			total += vma; vma = 0;
+			start = s; end = e;
+			continue;
+		}
+		if ((end<=lo)||(start>=hi)){ continue; }
+		if (sscanf(line, "%63s %ld", key, &kb)!=2){ continue; }
+		if ((strcmp(key, "AnonHugePages:")==0)||(strcmp(key, "Private_Hugetlb:")==0)||
+				(strcmp(key, "Shared_Hugetlb:")==0))
+		{
+			// Count at most the part of the mapping inside the range.
+			vma = min((long)(min(end, hi)-max(start, lo)), vma+kb*1024);
+		}
+	}
+	fclose(f);
+	return total+vma;
 }
 
 paraSA::paraSA(string &S_,
 							 vector<long> &descr_,
 							 vector<long> &startpos_,
 							 bool __4column, 
-							 long K_) : descr(descr_), startpos(startpos_), S(S_) 
+							 long K_,
+							 bool build) : descr(descr_), startpos(startpos_), S(S_) 
 {
   _4column = __4column;
   K = K_;
+#ifdef GCLUST_MPI
+	win = MPI_WIN_NULL;
+#endif
 
 	if(S.length() % K != 0) {
     long appendK = K - S.length() % K ;
@@ -549,6 +1128,12 @@ paraSA::paraSA(string &S_,
 	// Append "special" end character. Note: It must be lexicographically less.
   for(long i = 0; i < K; i++) S += '$'; 
   N = S.length();
+	if (!build)
+	{
+		logN = (long)ceil(log(N/K) / log(2.0));
+		NKm1 = N/K-1;
+		return;
+	}
 
 		// Sparse suffix array construction part
 	if(K > 1) 
@@ -619,6 +1204,68 @@ paraSA::paraSA(string &S_,
 
 }
 
+paraSA::paraSA(paraSA &src, string &S_) : descr(src.descr), startpos(src.startpos), S(S_)
+{
+	_4column = src._4column;
+	N = src.N;
+	logN = src.logN;
+	NKm1 = src.NKm1;
+	K = src.K;
+	SA.copy_from(src.SA);
+	ISA.copy_from(src.ISA);
+	LCP.vec.copy_from(src.LCP.vec);
+	LCP.M.copy_from(src.LCP.M);
+#ifdef GCLUST_MPI
+	win = MPI_WIN_NULL;
+#endif
+}
+
+#ifdef GCLUST_MPI
+// Note: the arrays are laid out back to back in the window, each one 
+// starting on an 8 byte boundary. Window pages are only backed once 
+// written, and each private array is released as soon as it is copied,
+// so the building rank holds at most one array twice.
+void paraSA::share(MPI_Comm node)
+{
+	int noderank, unit;
+	long len[4], off[5];
+	MPI_Aint size;
+	char *base;
+
+	MPI_Comm_rank(node, &noderank);
+	len[0] = SA.size(); len[1] = ISA.size();
+	len[2] = LCP.vec.size(); len[3] = LCP.M.size();
+	MPI_Bcast(len, 4, MPI_LONG, 0, node);
+	off[0] = 0;
+	off[1] = off[0] + (long)((len[0]*sizeof(unsigned int)+7)&~7UL);
+	off[2] = off[1] + (long)((len[1]*sizeof(int)+7)&~7UL);
+	off[3] = off[2] + (long)((len[2]+7)&~7UL);
+	off[4] = off[3] + (long)(len[3]*sizeof(vec_uchar::item_t));
+	MPI_Win_allocate_shared((noderank==0) ? off[4] : 0, 1, MPI_INFO_NULL, 
+													node, &base, &win);
+	if (noderank==0)
+	{
+		SA.move_to((unsigned int *)(base+off[0]));
+		ISA.move_to((int *)(base+off[1]));
+		LCP.vec.move_to((unsigned char *)(base+off[2]));
+		LCP.M.move_to((vec_uchar::item_t *)(base+off[3]));
+		MPI_Barrier(node);
+		return;
+	}
+	MPI_Win_shared_query(win, 0, &size, &unit, &base);
+	MPI_Barrier(node);
+	SA.view((unsigned int *)(base+off[0]), len[0]);
+	ISA.view((int *)(base+off[1]), len[1]);
+	LCP.vec.view((unsigned char *)(base+off[2]), len[2]);
+	LCP.M.view((vec_uchar::item_t *)(base+off[3]), len[3]);
+}
+
+paraSA::~paraSA()
+{
+	if (win != MPI_WIN_NULL){ MPI_Win_free(&win); }
+}
+#endif
+
 // Suffix sort part.
 void paraSA::update_group(int *pl, int *pm)
 {
@@ -1107,7 +1754,7 @@ bool paraSA::suffixlink(interval_t &m)
 // For a given offset in the prefix k, find all MEMs.
 void paraSA::findMEM(long k, 
 										 string &P,
-										 vector<match_t> &matches,
+										 match_buf &matches,
 										 int min_len,
 										 long id) 
 {
@@ -1153,7 +1800,7 @@ void paraSA::findMEM(long k,
 // For a given offset in the prefix k, find all MEMs. (100%)
 void paraSA::findMEMperfect(long k, 
 														string &P,
-														vector<match_t> &matches,
+														match_buf &matches,
 														int min_len,
 														long id) 
 {
@@ -1184,7 +1831,7 @@ void paraSA::collectMEMs(string &P,
 												 long prefix,
 												 interval_t mli,
 												 interval_t xmi,
-												 vector<match_t> &matches,
+												 match_buf &matches,
 												 int min_len,
 												 long id)
 {
@@ -1221,7 +1868,7 @@ void paraSA::collectMEMs(string &P,
 // Use LCP information to locate right maximal matches. Test each for
 // left maximality.
 void paraSA::collectMEMsperfect(string &P, long prefix, interval_t mli, \
-	interval_t xmi, vector<match_t> &matches, int min_len, long id) 
+	interval_t xmi, match_buf &matches, int min_len, long id) 
 {
 	//All of the suffixes in xmi's interval are right maximal.
   for(long i = xmi.start; i <= xmi.end; i++) 
@@ -1234,7 +1881,7 @@ void paraSA::find_Lmaximal(string &P,
 													 long prefix,
 													 long i,
 													 long len,
-													 vector<match_t> &matches,
+													 match_buf &matches,
 													 int min_len,
 													 long id) 
 {
@@ -1249,7 +1896,7 @@ void paraSA::find_Lmaximal(string &P,
 					long refseq=0, refpos=0;
 					from_set(i, refseq, refpos);
 					if (descr[refseq]<id){
-						matches.push_back(match_t(prefix, len, refseq, refpos));
+						matches.push(match_t(prefix, len, refseq, refpos));
 					}
 				}
 				return; // Reached mismatch, done.
@@ -1260,7 +1907,7 @@ void paraSA::find_Lmaximal(string &P,
 					long refseq=0, refpos=0;
 					from_set(i, refseq, refpos);
 					if (descr[refseq]<id){
-						matches.push_back(match_t(prefix, len, refseq, refpos));
+						matches.push(match_t(prefix, len, refseq, refpos));
 					}
 				}
 				return; // Reached mismatch, done.
@@ -1273,7 +1920,7 @@ void paraSA::find_Lmaximal(string &P,
 
 // Load matching information.
 long paraSA::load_match_info(long id, 
-														 vector<match_t> &buf,
+														 match_buf &buf,
 														 vector<mumi_unit> &mumiunits,
 														 bool rc,
 														 long qlen) 
@@ -1282,11 +1929,17 @@ long paraSA::load_match_info(long id,
 	mumi_unit mu;
 	long refseq, refpos, bufs, addsize=0;
 	bufs=(long)buf.size();
+	// Grow geometrically, but never past the buffer bound.
+	if ((long)mumiunits.capacity() < (long)mumiunits.size()+bufs)
+	{
+		long want = max((long)mumiunits.size()+bufs, 2*(long)mumiunits.capacity());
+		mumiunits.reserve(max(min(buf.cap, want), (long)mumiunits.size()+bufs));
+	}
 
 	// from_set is slow!!!
 	for(long i=0; i<bufs; i++)
 	{
-		m=buf[i];
+		m=buf.vec[i];
 		refseq=m.refseq;
 		refpos=m.refpos;
 		addsize+=m.len;
@@ -1317,6 +1970,135 @@ long paraSA::load_match_info(long id,
 
 }
 
+// Order matches by reference sequence.
+static bool refseq_less(const match_t &a, const match_t &b)
+{
+	return a.refseq < b.refseq;
+}
+
+// Sort the stored matches by reference and append them to the spill
+// file as one run.
+void match_buf::spill_run()
+{
+	if (spill == NULL)
+	{
+		spill = tmpfile();
+		if (spill == NULL)
+		{
+			cerr << "unable to create the match spill file" << endl;
+			exit(1);
+		}
+	}
+	if (runs.empty()){ runs.push_back(0); runpos.push_back(0); }
+	stable_sort(vec.begin(), vec.end(), refseq_less);
+	for (long i=0; i<(long)vec.size(); i++)
+	{
+		long r = vec[i].refseq;
+		if (r >= (long)refcount.size()){ refcount.resize(r+1, 0); reflen.resize(r+1, 0); }
+		if ((i == 0)||(vec[i-1].refseq != r))
+		{
+			runref.push_back(r);
+			runstart.push_back(runs.back()+i);
+		}
+		refcount[r]++;
+		reflen[r] += vec[i].len;
+	}
+	if ((!vec.empty())&&(fwrite(&vec[0], sizeof(match_t), vec.size(), spill) != vec.size()))
+	{
+		cerr << "unable to write the match spill file" << endl;
+		exit(1);
+	}
+	runs.push_back(runs.back()+(long)vec.size());
+	runpos.push_back((long)runref.size());
+	vec.clear();
+	overflow = true;
+}
+
+// Order reference sequences by decreasing match length.
+struct reflen_greater
+{
+	vector<long> &reflen;
+	reflen_greater(vector<long> &reflen_) : reflen(reflen_) {}
+	bool operator() (long a, long b) const { return reflen[a] > reflen[b]; }
+
+};
+
+// Load the spilled matches of the next references into vec, as many whole
+// references as fit in cap. A reference with more matches than cap is 
+// loaded whole on its own, its identity needs all of them. Returns false
+// when every reference was loaded.
+// Note: references come in sequence order, or with bycoverage by 
+// decreasing total match length as RankMemCandidates ranks them, so the
+// batches hold the candidates in the order one search in memory would
+// evaluate them. Each reference's matches keep their search order.
+bool match_buf::next_batch(bool bycoverage)
+{
+	long nruns = (long)runs.size()-1;
+	if ((nextref == 0)&&(order.empty()))
+	{
+		if (fflush(spill) != 0)
+		{
+			cerr << "unable to write the match spill file" << endl;
+			exit(1);
+		}
+		for (long r=0; r<(long)refcount.size(); r++){ if (refcount[r] > 0) order.push_back(r); }
+		if (bycoverage){ stable_sort(order.begin(), order.end(), reflen_greater(reflen)); }
+	}
+	long nref = (long)order.size();
+	if (nextref >= nref){ return false; }
+	long hi = nextref, total = 0;
+	while ((hi < nref)&&((hi == nextref)||(total+refcount[order[hi]] <= cap)))
+	{
+		total += refcount[order[hi]];
+		hi++;
+	}
+	vec.resize(total);
+	long at = 0;
+	// Each reference is read from the runs holding it, in run order.
+	for (long b=nextref; b<hi; b++)
+	{
+		for (long k=0; k<nruns; k++)
+		{
+			vector<long>::iterator first = runref.begin()+runpos[k], last = runref.begin()+runpos[k+1];
+			vector<long>::iterator it = lower_bound(first, last, order[b]);
+			if ((it == last)||(*it != order[b])){ continue; }
+			long j = it-runref.begin();
+			long lo = runstart[j], up = (j+1 < runpos[k+1]) ? runstart[j+1] : runs[k+1];
+			long n = up-lo;
+			ssize_t bytes = n*sizeof(match_t);
+			if ((n > 0)&&(pread(fileno(spill), &vec[at], bytes, lo*sizeof(match_t)) != bytes))
+			{
+				cerr << "unable to read the match spill file" << endl;
+				exit(1);
+			}
+			at += n;
+		}
+	}
+	nextref = hi;
+	return true;
+}
+
+// Empty the spill file for the next search, it stays open.
+void match_buf::reset_spill()
+{
+	runs.clear();
+	runpos.clear();
+	runref.clear();
+	runstart.clear();
+	refcount.clear();
+	reflen.clear();
+	order.clear();
+	nextref = 0;
+	// Storage grown past cap by a large reference is released.
+	if ((long)vec.capacity() > cap){ vector<match_t>().swap(vec); }
+	overflow = false;
+	if (spill != NULL)
+	{
+		rewind(spill);
+		if (ftruncate(fileno(spill), 0) != 0){ cerr << "unable to reset the match spill file" << endl; }
+	}
+}
+
 // Finds maximal almost-unique matches (MAMs) 
 bool paraSA::is_leftmaximal(string &P, long p1, long p2) 
 {
@@ -1335,7 +2117,7 @@ struct thread_data
 
 // Maximal Exact Matches (MEMs) 
 void paraSA::MEM(string &P,
-								 vector<match_t> &matches,
+								 match_buf &matches,
 								 int min_len,
 								 long id) 
 {		
@@ -1347,7 +2129,7 @@ void paraSA::MEM(string &P,
 
 // Maximal Exact Matches 100% (MEMs) 
 void paraSA::MEMperfect(string &P, 
-												vector<match_t> &matches, 
+												match_buf &matches, 
 												int min_len, 
 												long id) 
 {		
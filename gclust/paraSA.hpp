@@ -6,10 +6,18 @@
 #include <iostream>
 #include <algorithm>
 #include <limits>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef GCLUST_MPI
+#include <mpi.h>
+#endif
 
 using namespace std;
 
 #include "fasta.hpp"
+#include "extend.hpp"
 
 // MUMI index cutoff unit.
 struct mumi_unit
@@ -28,21 +36,81 @@ struct mumi_unit
 
 };
 
+// Per-thread scratch containers of the identity pipeline. They are
+// cleared, never freed, between references and queries, so once their
+// capacity is warmed up the per-pair hot path does no heap allocation.
+struct mem_scratch
+{
+	vector<mumi_unit> singleunits, removes, dremoves, ddremoves, mergeunits;
+	vector<mumi_unit> bucketed; // Query units grouped by reference.
+	vector<long> bucketpos, coverage, candidates; // Per reference of the chunk.
+	vector<double> distances; // Identity per candidate.
+	ext_seq qrc; // Reverse complemented query for extension.
+	xdrop_buf xdrop; // Anti-diagonals of the gapped extension.
+	vector<pair<long, long> > gaps; // Pending extensions, (-length, unit).
+	vector<xdrop_lane> lanes; // One batch of ungapped extensions.
+	vector<hit_edge> hits; // Hits of the thread's queries in this pass.
+
+	// O(1) reset, mumi_unit is trivially destructible.
+	void reset()
+	{
+		singleunits.clear();
+		removes.clear();
+		dremoves.clear();
+		ddremoves.clear();
+		mergeunits.clear();
+	}
+
+};
+
+// Read-only extension sequences of the run, indexed by genome id and
+// shared by all threads.
+struct genome_cache
+{
+	vector<ext_seq> seqs;
+
+};
+
+// Order candidate references by decreasing raw MEM coverage.
+struct coverage_greater
+{
+	vector<long> &coverage;
+	coverage_greater(vector<long> &coverage_) : coverage(coverage_) {}
+	bool operator() (long a, long b) const { return coverage[a] > coverage[b]; }
+
+};
+
 // Order G0.
 bool compareg0(const mumi_unit lhs, const mumi_unit rhs);
 // Order G1.
 bool compareg1(const mumi_unit lhs, const mumi_unit rhs);
 
+// States of the genomes of a chunk in online part clustering.
+const char REF_PENDING = 0; // Not decided yet.
+const char REF_REP = 1; // Representative.
+const char REF_CLUSTERED = 2; // Clustered, or not queried.
+
+// Wait until a state is decided and return it, states are set once per
+// pass through publish_state.
+char wait_state(char *state);
+void publish_state(char *state, char value);
+
 // Compute genome identity.
+// With refstate (online part clustering, else NULL) only references in
+// state REF_REP are evaluated, up to the first hit.
 bool ComputeMemIdentity(vector<GenomeClustInfo> &totalgenomes,
-												vector<Genome> &allpartgenomes,
+												genome_cache &genomes,
 												vector<mumi_unit> &mumiunits,
+												mem_scratch &scratch,
 												long beginclust,
 												long id,
 												int MEMiden,
 												bool part,
 												long chunk,
 												char strand,
+												bool rank,
+												bool lazy,
+												char *refstate,
 												int ext, //extension options
 												int mas,
 												int umas,
@@ -50,6 +118,45 @@ bool ComputeMemIdentity(vector<GenomeClustInfo> &totalgenomes,
 												int gape,
 												int drops);
 
+// Compute identity against one reference.
+double PairMemIdentity(vector<GenomeClustInfo> &totalgenomes,
+											 genome_cache &genomes,
+											 ext_seq const *query,
+											 const mumi_unit *units,
+											 long nunits,
+											 mem_scratch &scratch,
+											 long id,
+											 long iref,
+											 char strand,
+											 double miniden,
+											 bool lazy,
+											 int ext,
+											 int mas,
+											 int umas,
+											 int gapo,
+											 int gape,
+											 int drops);
+
+// Group units by reference and rank the candidate references, ext is 0
+// when no extension runs.
+void RankMemCandidates(vector<GenomeClustInfo> &totalgenomes,
+											 vector<mumi_unit> &mumiunits,
+											 mem_scratch &scratch,
+											 long beginclust,
+											 long sid,
+											 long qsize,
+											 double miniden,
+											 bool rank,
+											 int ext,
+											 int mas,
+											 int umas,
+											 int gape,
+											 int drops);
+
+// Identity pool shared by the workers of one pass.
+void iden_pool_begin(int workers);
+void iden_pool_help(mem_scratch &scratch);
+
 void collectg0(vector<mumi_unit> &singleunits);
 void collectg1(vector<mumi_unit> &singleunits);
 
@@ -64,12 +171,17 @@ void merging(vector<mumi_unit> &ddremoves, vector<mumi_unit> &mergeunits);
 double tell_me(vector<mumi_unit> &ddremoves,long size);
 
 // seed extension part
+// Convert the run's genomes for extension.
+void build_genome_cache(vector<Genome> &allpartgenomes, genome_cache &genomes, bool packed);
+void reverse_codes(string const &codes, string &rc);
 // Seed extension with two directions
 void seedextensions(vector<mumi_unit> &ddremoves,
-									 vector<Genome> &allpartgenomes,
-									 long id, 
-									 long iref, 
-									 char strand,
+									 ext_seq const &seq0,
+									 ext_seq const &seq1,
+									 mem_scratch &scratch,
+									 long qsize,
+									 double miniden,
+									 bool lazy,
 									 int ext, //extension options
 									 int mas,
 									 int umas,
@@ -77,6 +189,82 @@ void seedextensions(vector<mumi_unit> &ddremoves,
 									 int gape,
 									 int drops);
 
+extern bool hugepages; // Back the index arrays with 2 MB pages.
+
+const size_t HUGE_PAGE = 2UL<<20;
+
+// Anonymous zeroed mapping of bytes on 2 MB pages, from the hugetlb pool
+// when it has enough free pages, else aligned and advised for transparent
+// huge pages. len receives the mapped size.
+// Returns NULL when -hugepages is off or bytes is below one huge page.
+void *index_map(size_t bytes, size_t &len);
+
+// Bytes of [p, p+bytes) backed by huge pages, from /proc/self/smaps.
+long hugepage_bytes(const void *p, size_t bytes);
+
+// Array of the suffix array index, owned or a view of memory shared by
+// the ranks of a node in MPI builds.
+template <class T> struct index_array
+{
+	vector<T> own;
+	T *heap; // malloc'ed storage taken over by adopt(), or NULL.
+	void *map; // Huge page storage from index_map(), or NULL.
+	size_t maplen;
+	T *ptr;
+	long n;
+
+	index_array() : heap(NULL), map(NULL), maplen(0), ptr(NULL), n(0) {}
+	~index_array() { free(heap); unmap(); }
+	void unmap() { if (map!=NULL){ munmap(map, maplen); map = NULL; } }
+	// Note: only used on empty arrays, the N elements are zero.
+	void resize(size_t N) 
+	{ 
+		if (map_huge(N)){ return; }
+		own.resize(N); ptr = (N>0) ? &own[0] : NULL; n = N; 
+	}
+	void push_back(const T &v) { own.push_back(v); ptr = &own[0]; n = own.size(); }
+	// Point at external memory, the owned copy is released.
+	void view(T *p, long N) { vector<T>().swap(own); unmap(); ptr = p; n = N; }
+	// Copy into external memory of n elements and release the own storage.
+	void move_to(T *p) 
+	{ 
+		if (n>0){ memcpy(p, ptr, n*sizeof(T)); }
+		view(p, n);
+		free(heap); heap = NULL;
+	}
+	// Take over malloc'ed storage holding the same values.
+	void adopt(T *p) { view(p, n); free(heap); heap = p; }
+	// Own copy of src, first touched by the calling thread.
+	void copy_from(index_array<T> &src) 
+	{ 
+		if (map_huge(src.n))
+		{
+			memcpy(ptr, src.ptr, src.n*sizeof(T));
+			return;
+		}
+		own.assign(src.ptr, src.ptr+src.n);
+		ptr = (src.n>0) ? &own[0] : NULL;
+		n = src.n;
+	}
+	// Replace the storage by N elements on huge pages, if index_map() 
+	// gives them.
+	bool map_huge(size_t N)
+	{
+		size_t len;
+		void *p = index_map(N*sizeof(T), len);
+		if (p==NULL){ return false; }
+		view((T *)p, N);
+		free(heap); heap = NULL;
+		map = p; maplen = len;
+		return true;
+	}
+	T &operator[] (size_t idx) { return ptr[idx]; }
+	T *begin() { return ptr; }
+	T *end() { return ptr+n; }
+	long size() const { return n; }
+
+};
+
 struct vec_uchar 
 {
   struct item_t
@@ -85,8 +273,8 @@ struct vec_uchar
     size_t idx; int val;
     bool operator < (item_t t) const { return idx < t.idx; }
   };
-  vector<unsigned char> vec;  // LCP values from 0-65534
-  vector<item_t> M;
+  index_array<unsigned char> vec;  // LCP values from 0-65534
+  index_array<item_t> M;
   void resize(size_t N) { vec.resize(N); }
   
 	// Vector X[i] notation to get LCP values.
@@ -103,10 +291,10 @@ struct vec_uchar
 	{
 		if(v >= numeric_limits<unsigned char>::max()) 
 		{
-      vec.at(idx) = numeric_limits<unsigned char>::max();
+      vec[idx] = numeric_limits<unsigned char>::max();
       M.push_back(item_t(idx, v));
     }else{ 
-			vec.at(idx) = (unsigned char)v; 
+			vec[idx] = (unsigned char)v; 
 		}
   }
 	// Once all the values are set, call init. This will assure the
@@ -133,6 +321,49 @@ struct match_t
 
 };
 
+// Bounded match container of one thread. Storage starts small and grows
+// geometrically up to cap matches; past that the matches are sorted by
+// reference and spilled to a temporary file as one run. After the search
+// the runs are read back a batch of whole references at a time, in the
+// order the candidates are evaluated in.
+struct match_buf
+{
+	vector<match_t> vec;
+	long cap; // Maximum number of stored matches.
+	long lensum; // Total length of the matches seen, stored or not.
+	bool overflow; // Some matches were spilled.
+	FILE *spill; // Runs of this search, opened on first use.
+	vector<long> runs; // Run boundaries in spill, in matches.
+	vector<long> runpos; // First entry of each run in runref.
+	vector<long> runref, runstart; // References of the runs and their first match.
+	vector<long> refcount; // Spilled matches per reference sequence.
+	vector<long> reflen; // Spilled match length per reference sequence.
+	vector<long> order; // References in batch order.
+	long nextref; // First entry of order in the next batch.
+
+	match_buf() { cap = numeric_limits<long>::max(); spill = NULL; overflow = false; nextref = 0; clear(); }
+	~match_buf() { if (spill != NULL) fclose(spill); }
+	void clear() { vec.clear(); lensum = 0; if (overflow) reset_spill(); }
+	long size() { return (long)vec.size(); }
+
+	void push(const match_t &m) 
+	{
+		lensum += m.len;
+		if ((long)vec.size() >= cap) { spill_run(); }
+		if (vec.size() == vec.capacity()) 
+		{
+			long want = max((long)MIN_THREADCONTAINER, 2*(long)vec.capacity());
+			vec.reserve(min(cap, want));
+		}
+		vec.push_back(m);
+	}
+
+	void spill_run();
+	bool next_batch(bool bycoverage);
+	void reset_spill();
+
+};
+
 // Match find by findMEM. 
 struct postmatch_t 
 {
@@ -166,8 +397,8 @@ struct paraSA
   long logN; // ceil(log(N)) 
   long NKm1; // N/K - 1
   string &S; //!< Reference to sequence data.
-  vector<unsigned int> SA;  // Suffix array.
-  vector<int> ISA;  // Inverse suffix array.
+  index_array<unsigned int> SA;  // Suffix array.
+  index_array<int> ISA;  // Inverse suffix array.
 	vec_uchar LCP; // Simulates a vector<int> LCP.
   long K; // suffix sampling, stable K = 1.
 
@@ -206,12 +437,24 @@ struct paraSA
     it--;
     seqpos = hit - *it;
 	}
-  // Constructor builds sparse suffix array. 
+  // Constructor builds sparse suffix array. Without build only S is
+  // prepared, the index arrays then come from share().
   paraSA(string &S_, 
 				 vector<long> &descr_,
 				 vector<long> &startpos_,
 				 bool __4column, 
-				 long K_);
+				 long K_,
+				 bool build = true);
+	// Copy of src searching S_, a copy of src's text. The arrays are first
+	// touched by the calling thread, i.e. placed on its NUMA node.
+	paraSA(paraSA &src, string &S_);
+#ifdef GCLUST_MPI
+	MPI_Win win; // Shared index of the node, or MPI_WIN_NULL.
+	// Move SA, ISA and LCP into a window shared by the ranks of node, 
+	// where rank 0 has built them. Collective over node.
+	void share(MPI_Comm node);
+	~paraSA();
+#endif
 
 	// suffix sort part
 	void suffixsort(int *x, int *p, int n, int k, int l);
@@ -280,7 +523,7 @@ struct paraSA
 														long prefix,
 														long i,
 														long len,
-														vector<match_t> &matches,
+														match_buf &matches,
 														int min_len,
 														long id);
 
@@ -290,7 +533,7 @@ struct paraSA
 									 long prefix,
 									 interval_t mli,
 									 interval_t xmi,
-									 vector<match_t> &matches,
+									 match_buf &matches,
 									 int min_len,
 									 long id);
 	// 100% match
@@ -298,33 +541,33 @@ struct paraSA
 													long prefix, 
 													interval_t mli, 
 													interval_t xmi, 
-													vector<match_t> &matches, 
+													match_buf &matches, 
 													int min_len, 
 													long id);
 
   // Find all MEMs given a prefix pattern offset k.
   void findMEM(long k, 
 							 string &P,
-							 vector<match_t> &matches,
+							 match_buf &matches,
 							 int min_len,
 							 long id);
 
 	void findMEMperfect(long k, 
 											string &P, 
-											vector<match_t> &matches, 
+											match_buf &matches, 
 											int min_len, 
 											long id);
   
 	//void findMAM(string &P, vector<match_t> &matches, int min_len, bool print);
   inline bool is_leftmaximal(string &P, long p1, long p2);
   // Find Maximal Exact Matches (MEMs) 
-  void MEM(string &P, vector<match_t> &matches, int min_len, long id);
-	void MEMperfect(string &P, vector<match_t> &matches, int min_len, long id);
+  void MEM(string &P, match_buf &matches, int min_len, long id);
+	void MEMperfect(string &P, match_buf &matches, int min_len, long id);
 
   // Maximal Unique Match (MUM) 
   // void MUM(string &P, vector<match_t> &unique, int min_len, bool print);
 	long load_match_info(long id, 
-											 vector<match_t> &buf,
+											 match_buf &buf,
 											 vector<mumi_unit> &mumiunits,
 											 bool rc,
 											 long qlen);